@@ -1,5 +1,13 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -27,29 +35,33 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of
+** operation: String, Mmap, File and Pipe.
 **
-** String is easy. The whole contents are
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making
-** backtracking easy.
+** String is easy. The contents are borrowed
+** from the caller, never copied, and scanned
+** through in place. The cursor can jump around
+** at will making backtracking easy.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** Mmap is the same for files that can be mapped
+** into memory read-only, so a file of any size
+** is scanned without a resident copy of it.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** File and Pipe are read a block at a time into
+** a ring buffer. Positions are absolute offsets
+** into the input and the ring holds everything
+** from the oldest mark - or the cursor, when
+** nothing is marked - up to what has been read.
+** Rewinding just moves the cursor back, and the
+** ring only grows while a mark holds on to more
+** than fits, so either input parses in linear
+** time without seeking. Pipes fill a block no
+** further than the end of a line so that lines
+** typed interactively are parsed as they come.
 **
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** What was read ahead of the cursor is handed
+** back once parsing is done, by seeking for a
+** File and pushing it back for a Pipe.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -60,11 +72,13 @@ static mpc_state_t mpc_state_new(void) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_BLOCK = 4096
 };
 
 enum {
@@ -75,23 +89,90 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** While parsing, positions are plain byte offsets.
+** Rows and columns are only worked out when a state
+** leaves the input, from an index of the newlines
+** scanned so far relative to where the input began.
+*/
+
+typedef struct {
+  long pos;
+  int term;
+  char last;
+} mpc_mark_t;
+
+/*
+** When packrat parsing is switched on the input carries
+** a memo table of rule results, keyed by the rule and the
+** offset it was tried at. A hit either replays where the
+** rule finished along with a copy of its output, or hands
+** back a copy of the error it failed with. A result cut
+** short by the recursion limit also records the depth it
+** was reached at, and only replays at that depth.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  long end;
+  int depth;
+  int term;
+  char last;
+  char suppressed;
+  char exhausted;
+  char success;
+  mpc_val_t *output;
+  mpc_err_t *error;
+} mpc_memo_entry_t;
+
+typedef struct {
+  int policy;
+  long window;
+  mpc_apply_t copy;
+  mpc_dtor_t dx;
+  mpc_parser_t *busy;
+  size_t num;
+  size_t slots;
+  mpc_memo_entry_t *entries;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
   char *filename;
   mpc_state_t state;
+  mpc_state_t origin;
 
-  char *string;
+  const char *string;
   char *buffer;
+  long buffer_start;
+  long buffer_end;
+  long buffer_slots;
   FILE *file;
+  long offset;
+  long length;
+  int exhausted;
+
+  long *lines;
+  long lines_num;
+  long lines_slots;
+  long lines_row;
+  long lines_last;
+  long lines_from;
+  long scanned;
 
   int suppress;
   int backtrack;
   int marks_slots;
   int marks_num;
-  mpc_state_t *marks;
+  mpc_mark_t *marks;
+
+  mpc_memo_t *memo;
+  int overflow;
+  int failures;
+  int partial;
 
-  char *lasts;
   char last;
 
   size_t mem_index;
@@ -100,7 +181,7 @@ typedef struct {
 
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
@@ -109,57 +190,76 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->type = MPC_INPUT_STRING;
 
   i->state = mpc_state_new();
+  i->origin = i->state;
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
+  i->offset = 0;
+  i->length = (long)length;
+  i->exhausted = 0;
+
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_row = 0;
+  i->lines_last = -1;
+  i->lines_from = 0;
+  i->scanned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->marks = malloc(sizeof(mpc_mark_t) * i->marks_slots);
+  i->memo = NULL;
+  i->overflow = 0;
+  i->failures = 0;
+  i->partial = 0;
   i->last = '\0';
 
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
+
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+#ifdef MPC_MMAP
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+static mpc_input_t *mpc_input_new_mmap(const char *filename) {
 
-  i->state = mpc_state_new();
+  mpc_input_t *i;
+  struct stat st;
+  void *map;
+  int fd = open(filename, O_RDONLY);
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
+  if (fd < 0) { return NULL; }
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  /* Empty and special files can't be mapped */
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return NULL; }
 
+  i = mpc_input_new_nstring(filename, map, (size_t)st.st_size);
+  i->type = MPC_INPUT_MMAP;
   return i;
-
 }
 
+#endif
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -169,17 +269,35 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   i->type = MPC_INPUT_PIPE;
   i->state = mpc_state_new();
+  i->origin = i->state;
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->buffer = malloc(MPC_INPUT_BLOCK);
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->buffer_slots = MPC_INPUT_BLOCK;
   i->file = pipe;
+  i->offset = 0;
+  i->length = 0;
+  i->exhausted = 0;
+
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_row = 0;
+  i->lines_last = -1;
+  i->lines_from = 0;
+  i->scanned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->marks = malloc(sizeof(mpc_mark_t) * i->marks_slots);
+  i->memo = NULL;
+  i->overflow = 0;
+  i->failures = 0;
+  i->partial = 0;
   i->last = '\0';
 
   i->mem_index = 0;
@@ -190,29 +308,8 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
-
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
+  mpc_input_t *i = mpc_input_new_pipe(filename, file);
   i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = file;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
 }
 
@@ -220,11 +317,32 @@ static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+#ifdef MPC_MMAP
+  if (i->type == MPC_INPUT_MMAP) { munmap((void*)i->string, (size_t)i->length); }
+#endif
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos - i->buffer_end, SEEK_CUR);
+  }
+
+  /*
+  ** Whatever was read past the end of the parse goes back
+  ** on the pipe. ISO C only promises one character of
+  ** pushback, but glibc and the BSDs take as many as memory
+  ** allows, which mpc has always relied on here. Reads stop
+  ** at each newline to keep this to the rest of a line,
+  ** unless the parse rewound further than that.
+  */
+  if (i->type == MPC_INPUT_PIPE) {
+    while (i->buffer_end > i->state.pos) {
+      i->buffer_end--;
+      if (ungetc(i->buffer[i->buffer_end & (i->buffer_slots-1)], i->file) == EOF) { break; }
+    }
+  }
+
+  free(i->buffer);
 
+  free(i->lines);
   free(i->marks);
-  free(i->lasts);
   free(i);
 }
 
@@ -306,21 +424,16 @@ static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->marks_num > i->marks_slots) {
     i->marks_slots = i->marks_num + i->marks_num / 2;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    i->marks = realloc(i->marks, sizeof(mpc_mark_t) * i->marks_slots);
   }
 
-  i->marks[i->marks_num-1] = i->state;
-  i->lasts[i->marks_num-1] = i->last;
-
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
+  i->marks[i->marks_num-1].pos = i->state.pos;
+  i->marks[i->marks_num-1].term = i->state.term;
+  i->marks[i->marks_num-1].last = i->last;
 
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -331,16 +444,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->marks_slots =
       i->marks_num > MPC_INPUT_MARKS_MIN ?
       i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
-  }
-
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    i->marks = realloc(i->marks, sizeof(mpc_mark_t) * i->marks_slots);
   }
 
 }
@@ -349,126 +453,156 @@ static void mpc_input_rewind(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
 
-  i->state = i->marks[i->marks_num-1];
-  i->last  = i->lasts[i->marks_num-1];
-
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
+  i->state.pos  = i->marks[i->marks_num-1].pos;
+  i->state.term = i->marks[i->marks_num-1].term;
+  i->last       = i->marks[i->marks_num-1].last;
 
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+static void mpc_input_lines_scan(mpc_input_t *i, const char *s, long n) {
+  const char *p = s, *e = s + n;
+  while ((p = memchr(p, '\n', (size_t)(e - p)))) {
+    if (i->lines_num == i->lines_slots) {
+      i->lines_slots = i->lines_slots ? i->lines_slots * 2 : 64;
+      i->lines = realloc(i->lines, sizeof(long) * i->lines_slots);
+    }
+    i->lines[i->lines_num++] = i->scanned + (p - s);
+    p++;
+  }
+  i->scanned += n;
 }
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+/*
+** File and pipe input forgets the newlines before anything
+** it could return to, counting them into the row, so the
+** index stays as small as the ring. Positions before that
+** can no longer be located, so errors on these inputs are
+** located as soon as they are made.
+*/
+
+static void mpc_input_lines_trim(mpc_input_t *i, long pos) {
+  long j = 0;
+  while (j < i->lines_num && i->lines[j] < pos) { j++; }
+  if (j > 0) {
+    i->lines_row += j;
+    i->lines_last = i->lines[j-1];
+    memmove(i->lines, i->lines + j, sizeof(long) * (i->lines_num - j));
+    i->lines_num -= j;
+  }
+  if (pos > i->lines_from) { i->lines_from = pos; }
 }
 
-static char mpc_input_getc(mpc_input_t *i) {
+static void mpc_input_locate(mpc_input_t *i, mpc_state_t *s) {
 
-  char c = '\0';
+  long lo = 0, hi, mid, end;
 
-  switch (i->type) {
+  if (s->pos < i->origin.pos || s->pos < i->lines_from) { return; }
+
+  /* Memory inputs are only scanned as far as asked */
+  if (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) {
+    end = s->pos < i->offset + i->length ? s->pos : i->offset + i->length;
+    if (end > i->scanned) {
+      mpc_input_lines_scan(i, i->string + (i->scanned - i->offset), end - i->scanned);
+    }
+  }
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
+  hi = i->lines_num;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (i->lines[mid] < s->pos) { lo = mid + 1; } else { hi = mid; }
+  }
 
-      if (!i->buffer) { c = getc(i->file); return c; }
+  s->row = i->origin.row + i->lines_row + lo;
+  s->col = i->lines_row + lo == 0
+    ? i->origin.col + (s->pos - i->origin.pos)
+    : s->pos - (lo == 0 ? i->lines_last : i->lines[lo-1]) - 1;
+}
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+static char mpc_input_memory_get(mpc_input_t *i) {
+  long j = i->state.pos - i->offset;
+  return j < i->length ? i->string[j] : '\0';
+}
 
-    default: return c;
+static void mpc_input_buffer_grow(mpc_input_t *i, long slots) {
+  long j;
+  char *buffer = malloc(slots);
+  for (j = i->buffer_start; j < i->buffer_end; j++) {
+    buffer[j & (slots-1)] = i->buffer[j & (i->buffer_slots-1)];
   }
+  free(i->buffer);
+  i->buffer = buffer;
+  i->buffer_slots = slots;
 }
 
-static char mpc_input_peekc(mpc_input_t *i) {
+static int mpc_input_buffer_fill(mpc_input_t *i) {
 
-  char c = '\0';
+  long at, n, j, slots;
+  int c;
 
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
+  /* Drop whatever neither a mark nor the cursor can return to */
+  i->buffer_start = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  mpc_input_lines_trim(i, i->buffer_start);
 
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
+  slots = i->buffer_slots;
+  while (i->buffer_end - i->buffer_start + MPC_INPUT_BLOCK > slots) { slots *= 2; }
+  if (slots != i->buffer_slots) { mpc_input_buffer_grow(i, slots); }
 
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
+  at = i->buffer_end & (i->buffer_slots-1);
+  n = i->buffer_slots - at < MPC_INPUT_BLOCK ? i->buffer_slots - at : MPC_INPUT_BLOCK;
 
-    case MPC_INPUT_PIPE:
+  if (i->type == MPC_INPUT_FILE) {
+    n = (long)fread(i->buffer + at, 1, (size_t)n, i->file);
+  } else {
+    c = '\0';
+    for (j = 0; j < n && c != '\n'; j++) {
+      c = getc(i->file);
+      if (c == EOF) { break; }
+      i->buffer[at + j] = (char)c;
+    }
+    n = j;
+  }
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+  /* Input leaves the ring, so newlines are indexed on the way in */
+  mpc_input_lines_scan(i, i->buffer + at, n);
+  i->buffer_end += n;
+  return n > 0;
+}
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+static char mpc_input_buffer_get(mpc_input_t *i) {
+  if (i->state.pos == i->buffer_end && !mpc_input_buffer_fill(i)) { return '\0'; }
+  return i->buffer[i->state.pos & (i->buffer_slots-1)];
+}
 
-    default: return c;
+static char mpc_input_getc(mpc_input_t *i) {
+  switch (i->type) {
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return mpc_input_memory_get(i);
+    case MPC_INPUT_FILE:
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
+    default: return '\0';
   }
+}
 
+static char mpc_input_peekc(mpc_input_t *i) {
+  return mpc_input_getc(i);
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  return mpc_input_peekc(i) == '\0';
+  if (mpc_input_peekc(i) != '\0') { return 0; }
+  i->exhausted = 1;
+  return 1;
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
-    default: { break; }
-  }
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
-  i->state.col++;
-
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
-  }
 
   if (o) {
     (*o) = mpc_malloc(i, 2);
@@ -565,6 +699,7 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
+  mpc_input_locate(i, r);
   return r;
 }
 
@@ -670,6 +805,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
   x->state = i->state;
+  if (i->type == MPC_INPUT_FILE || i->type == MPC_INPUT_PIPE) { mpc_input_locate(i, &x->state); }
   x->expected_num = 1;
   x->expected = mpc_malloc(i, sizeof(char*));
   x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
@@ -681,11 +817,13 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
+  i->failures++;
   if (i->suppress) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
   x->state = i->state;
+  if (i->type == MPC_INPUT_FILE || i->type == MPC_INPUT_PIPE) { mpc_input_locate(i, &x->state); }
   x->expected_num = 0;
   x->expected = NULL;
   x->failure = mpc_malloc(i, strlen(failure) + 1);
@@ -720,6 +858,7 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
+  mpc_input_locate(i, &x->state);
   for (j = 0; j < x->expected_num; j++) {
     x->expected[j] = mpc_export(i, x->expected[j]);
   }
@@ -862,6 +1001,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -876,6 +1016,32 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = NULL;
+  if (x->expected_num > 0) {
+    y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
+      y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+      strcpy(y->expected[j], x->expected[j]);
+    }
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->received = x->received;
+  return y;
+}
+
 /*
 ** Parser Type
 */
@@ -914,7 +1080,10 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_PACKRAT    = 29,
+  MPC_TYPE_DFA        = 30
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -930,6 +1099,8 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; int policy; long window; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_packrat_t;
+typedef struct { mpc_parser_t *x; int n; unsigned short *trans; char *accept; char *live; } mpc_pdata_dfa_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
@@ -949,6 +1120,8 @@ typedef union {
   mpc_pdata_check_t check;
   mpc_pdata_check_with_t check_with;
   mpc_pdata_predict_t predict;
+  mpc_pdata_packrat_t packrat;
+  mpc_pdata_dfa_t dfa;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -960,6 +1133,7 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1032,6 +1206,168 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Runs a compiled regex to its longest match, taking the
+** output as one substring. Reaching the end of input in
+** a state that could still go on counts as looking past
+** the end, just as the combinators would have.
+*/
+
+static int mpc_parse_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+
+  long start = i->state.pos, end = -1, j, n;
+  const unsigned char *b;
+  int s = 1;
+  char c;
+
+  if (d->accept[s]) { end = start; }
+
+  if (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) {
+
+    b = (const unsigned char*)i->string;
+    n = i->length;
+    j = start - i->offset;
+
+    while (j < n && b[j] && (s = d->trans[s * 256 + b[j]])) {
+      j++;
+      if (d->accept[s]) { end = j + i->offset; }
+    }
+
+    if (s && (j == n || b[j] == '\0') && d->live[s]) { i->exhausted = 1; }
+    if (end < 0) { return 0; }
+
+    *o = mpc_malloc(i, end - start + 1);
+    memcpy(*o, b + (start - i->offset), end - start);
+
+  } else {
+
+    /* The mark keeps the ring from dropping the match */
+    mpc_input_mark(i);
+
+    for (;;) {
+      c = mpc_input_getc(i);
+      if (c == '\0') {
+        if (d->live[s]) { i->exhausted = 1; }
+        break;
+      }
+      s = d->trans[s * 256 + (unsigned char)c];
+      if (!s) { break; }
+      i->state.pos++;
+      if (d->accept[s]) { end = i->state.pos; }
+    }
+
+    i->state.pos = start;
+    mpc_input_unmark(i);
+    if (end < 0) { return 0; }
+
+    *o = mpc_malloc(i, end - start + 1);
+    for (j = start; j < end; j++) {
+      (*o)[j - start] = i->buffer[j & (i->buffer_slots-1)];
+    }
+
+  }
+
+  (*o)[end - start] = '\0';
+  if (end > start) { i->last = (*o)[end - start - 1]; }
+  i->state.pos = end;
+  return 1;
+}
+
+/*
+** Packrat Memo Table
+**
+** Open addressing on (rule, offset, suppressed). Entries
+** are only ever added during a parse. The window policy
+** forgets anything tried further back than the window
+** whenever the table fills up, before deciding whether
+** it actually needs to grow.
+*/
+
+enum {
+  MPC_MEMO_SLOTS_MIN = 256
+};
+
+static mpc_memo_t *mpc_memo_new(mpc_pdata_packrat_t *d) {
+  mpc_memo_t *m = malloc(sizeof(mpc_memo_t));
+  m->policy = d->policy;
+  m->window = d->window;
+  m->copy = d->copy;
+  m->dx = d->dx;
+  m->busy = NULL;
+  m->num = 0;
+  m->slots = MPC_MEMO_SLOTS_MIN;
+  m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+  return m;
+}
+
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_t *m, mpc_parser_t *p, long pos, char suppressed) {
+
+  mpc_memo_entry_t *x;
+  unsigned long h = ((unsigned long)(size_t)p >> 4) * 31 + (unsigned long)pos * 2 + suppressed;
+  h *= 2654435761UL;
+  h ^= h >> 16;
+
+  for (;;) {
+    x = &m->entries[h & (m->slots-1)];
+    if (x->p == NULL) { return x; }
+    if (x->p == p && x->pos == pos && x->suppressed == suppressed) { return x; }
+    h++;
+  }
+}
+
+static void mpc_memo_entry_delete(mpc_input_t *i, mpc_memo_t *m, mpc_memo_entry_t *x) {
+  if (x->success) { mpc_parse_dtor(i, m->dx, x->output); }
+  else { mpc_err_delete_internal(i, x->error); }
+}
+
+static void mpc_memo_resize(mpc_input_t *i, mpc_memo_t *m) {
+
+  size_t j, slots = m->slots;
+  mpc_memo_entry_t *entries = m->entries;
+
+  if (m->policy == MPC_PACKRAT_WINDOW) {
+    for (j = 0; j < slots; j++) {
+      if (entries[j].p == NULL || entries[j].pos >= i->state.pos - m->window) { continue; }
+      mpc_memo_entry_delete(i, m, &entries[j]);
+      entries[j].p = NULL;
+      m->num--;
+    }
+  }
+
+  if (m->num * 2 > m->slots) { m->slots *= 2; }
+
+  m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+  for (j = 0; j < slots; j++) {
+    if (entries[j].p == NULL) { continue; }
+    *mpc_memo_find(m, entries[j].p, entries[j].pos, entries[j].suppressed) = entries[j];
+  }
+
+  free(entries);
+}
+
+static void mpc_memo_add(mpc_input_t *i, mpc_memo_t *m, mpc_memo_entry_t *x) {
+
+  mpc_memo_entry_t *y;
+
+  if ((m->num + 1) * 4 > m->slots * 3) { mpc_memo_resize(i, m); }
+
+  y = mpc_memo_find(m, x->p, x->pos, x->suppressed);
+  if (y->p && y->depth < 0) { mpc_memo_entry_delete(i, m, x); return; }
+  if (y->p) { mpc_memo_entry_delete(i, m, y); m->num--; }
+
+  *y = *x;
+  m->num++;
+}
+
+static void mpc_memo_delete(mpc_input_t *i, mpc_memo_t *m) {
+  size_t j;
+  for (j = 0; j < m->slots; j++) {
+    if (m->entries[j].p) { mpc_memo_entry_delete(i, m, &m->entries[j]); }
+  }
+  free(m->entries);
+  free(m);
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1044,6 +1380,8 @@ enum {
 
 #define MPC_MAX_RECURSION_DEPTH 1000
 
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
   int j = 0, k = 0;
@@ -1053,9 +1391,17 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
   if (depth == MPC_MAX_RECURSION_DEPTH)
   {
+    i->overflow++;
     MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
   }
 
+  if (i->memo) {
+    if (i->memo->busy == p) { i->memo->busy = NULL; }
+    else if (p->memo || (p->name && i->memo->policy != MPC_PACKRAT_RULES)) {
+      return mpc_parse_memo(i, p, r, e, depth);
+    }
+  }
+
   switch (p->type) {
 
     /* Basic Parsers */
@@ -1130,6 +1476,20 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
       }
 
+    case MPC_TYPE_DFA:
+      if (i->suppress && i->backtrack > 0) {
+        MPC_PRIMITIVE(mpc_parse_dfa(i, &p->data.dfa, (char**)&r->output));
+      }
+      return mpc_parse_run(i, p->data.dfa.x, r, e, depth+1);
+
+    case MPC_TYPE_PACKRAT:
+      if (i->memo) { return mpc_parse_run(i, p->data.packrat.x, r, e, depth+1); }
+      i->memo = mpc_memo_new(&p->data.packrat);
+      j = mpc_parse_run(i, p->data.packrat.x, r, e, depth+1);
+      mpc_memo_delete(i, i->memo);
+      i->memo = NULL;
+      return j;
+
     case MPC_TYPE_PREDICT:
       mpc_input_backtrack_disable(i);
       if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
@@ -1300,11 +1660,89 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 }
 
+/*
+** A memoised rule replays its first result at the same
+** offset. Anything it merged into the farthest failure
+** the first time is still there, so only the error it
+** returned needs handing back again.
+*/
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  mpc_memo_t *m = i->memo;
+  mpc_memo_entry_t *x, y;
+  int exhausted = i->exhausted;
+  int overflow = i->overflow;
+  char suppressed = i->suppress ? 1 : 0;
+
+  /* Without backtracking a failed rule can leave the input moved on */
+  if (i->backtrack < 1) {
+    m->busy = p;
+    return mpc_parse_run(i, p, r, e, depth);
+  }
+
+  x = mpc_memo_find(m, p, i->state.pos, suppressed);
+  if (x->p && (x->depth < 0 || x->depth == depth)) {
+    if (x->depth >= 0) { i->overflow++; }
+    i->exhausted = i->exhausted || x->exhausted;
+    if (!x->success) { MPC_FAILURE(mpc_err_copy(i, x->error)); }
+    i->state.pos = x->end;
+    i->state.term = x->term;
+    i->last = x->last;
+    MPC_SUCCESS(m->copy(x->output));
+  }
+
+  y.p = p;
+  y.pos = i->state.pos;
+  y.suppressed = suppressed;
+
+  i->exhausted = 0;
+  m->busy = p;
+  y.success = mpc_parse_run(i, p, r, e, depth);
+  y.exhausted = i->exhausted;
+  i->exhausted = exhausted || y.exhausted;
+
+  /*
+  ** Results cut short by the recursion limit depend on how
+  ** deep the caller is, so they are kept for that depth only.
+  ** Dropping them would leave deep input backtracking
+  ** exponentially once it passes the limit.
+  */
+  y.depth = i->overflow != overflow ? depth : -1;
+  if (y.success && m->copy == NULL) { return y.success; }
+
+  y.end = i->state.pos;
+  y.term = i->state.term;
+  y.last = i->last;
+  y.output = y.success ? m->copy(r->output) : NULL;
+  y.error = y.success ? NULL : mpc_err_copy(i, r->error);
+  mpc_memo_add(i, m, &y);
+
+  return y.success;
+}
+
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Errors are only wanted when a parse fails, so the
+** first attempt runs with them suppressed. This builds
+** no error objects and lets compiled regexes take their
+** fast path. On failure the input is rewound and parsed
+** again to collect the farthest failure exactly as if
+** errors had been tracked from the start.
+**
+** Memory inputs rewind with a mark. A file is read again
+** from where the parse began, so nothing holds its start
+** in the ring. A pipe cannot be read again, so it is
+** parsed once with errors tracked throughout. A stream
+** expecting more input skips the second attempt when the
+** first only ran out of input, as any error but a hard
+** failure is dropped in favour of waiting for more.
+*/
+
+static int mpc_parse_errors(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
@@ -1318,6 +1756,63 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   return x;
 }
 
+/* Read a file again from 'm', where the lines before it had been counted */
+static void mpc_input_reread(mpc_input_t *i, mpc_mark_t *m, long row, long last) {
+  fseek(i->file, m->pos - i->buffer_end, SEEK_CUR);
+  i->buffer_start = m->pos;
+  i->buffer_end = m->pos;
+  i->lines_num = 0;
+  i->lines_row = row;
+  i->lines_last = last;
+  i->lines_from = m->pos;
+  i->scanned = m->pos;
+  i->state.pos = m->pos;
+  i->state.term = m->term;
+  i->last = m->last;
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x, failures, exhausted = i->exhausted;
+  long row, last;
+  mpc_err_t *e = NULL;
+  mpc_mark_t start;
+
+  start.pos = i->state.pos;
+  start.term = i->state.term;
+  start.last = i->last;
+
+  if (i->type == MPC_INPUT_PIPE
+  || (i->type == MPC_INPUT_FILE && ftell(i->file) < 0)) {
+    return mpc_parse_errors(i, p, r);
+  }
+
+  if (i->type == MPC_INPUT_FILE) { mpc_input_lines_trim(i, start.pos); }
+  else { mpc_input_mark(i); }
+  row = i->lines_row;
+  last = i->lines_last;
+  failures = i->failures;
+  mpc_input_suppress_enable(i);
+  x = mpc_parse_run(i, p, r, &e, 0);
+  mpc_input_suppress_disable(i);
+
+  if (x) {
+    if (i->type != MPC_INPUT_FILE) { mpc_input_unmark(i); }
+    r->output = mpc_export(i, r->output);
+    return 1;
+  }
+
+  if (i->partial && i->exhausted && i->failures == failures) {
+    if (i->type != MPC_INPUT_FILE) { mpc_input_unmark(i); }
+    r->error = NULL;
+    return 0;
+  }
+
+  if (i->type == MPC_INPUT_FILE) { mpc_input_reread(i, &start, row, last); }
+  else { mpc_input_rewind(i); }
+  i->exhausted = exhausted;
+  return mpc_parse_errors(i, p, r);
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
@@ -1326,44 +1821,220 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+  FILE *f;
+  int res;
+
+#ifdef MPC_MMAP
+  mpc_input_t *i = mpc_input_new_mmap(filename);
+  if (i) {
+    res = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return res;
+  }
+#endif
+
+  f = fopen(filename, "rb");
+
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Streaming
+**
+** A stream accepts input in arbitrary chunks and
+** yields one result of its parser for each complete
+** form as soon as enough input has arrived. Only the
+** unconsumed tail is buffered, so memory is bounded
+** by the largest single form rather than the input.
+**
+** A successful parse is only final once something
+** other than the form itself follows it - a parse
+** running right up to the end of the buffer might
+** still grow with more input (e.g. `12` then `3`) -
+** unless the buffer ends in whitespace or the stream
+** has been finished. Likewise a failure after running
+** into the end of the buffer just means more input is
+** needed.
+**
+** The parser cannot pick up where it left off, so each
+** retry parses the form from its start again. Once a
+** form has grown past MPC_STREAM_EAGER bytes without
+** completing it is only retried when the unparsed tail
+** has doubled or the stream is finished. Parsing a large
+** form then costs about twice a single parse of it
+** rather than one parse per chunk fed, but it may not
+** be yielded until more input follows it.
+*/
+
+#define MPC_STREAM_EAGER 16384
+
+struct mpc_stream_t {
+  char *filename;
+  mpc_parser_t *parser;
+  mpc_dtor_t destructor;
+  mpc_state_t state;
+  char *buffer;
+  size_t start;
+  size_t length;
+  size_t slots;
+  size_t retry;
+  int finished;
+};
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->filename = malloc(strlen(filename) + 1);
+  strcpy(s->filename, filename);
+  s->parser = p;
+  s->destructor = d;
+  s->state = mpc_state_new();
+  s->slots = 64;
+  s->start = 0;
+  s->length = 0;
+  s->retry = 0;
+  s->buffer = malloc(s->slots);
+  s->finished = 0;
+  return s;
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  free(s->filename);
+  free(s->buffer);
+  free(s);
+}
+
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length) {
+
+  /* Consumed input is dropped once per feed, not per form */
+  if (s->start > 0) {
+    memmove(s->buffer, s->buffer + s->start, s->length - s->start);
+    s->length -= s->start;
+    s->start = 0;
+  }
+
+  if (s->length + length > s->slots) {
+    while (s->length + length > s->slots) { s->slots = s->slots * 2; }
+    s->buffer = realloc(s->buffer, s->slots);
+  }
+  memcpy(s->buffer + s->length, data, length);
+  s->length += length;
+}
+
+void mpc_stream_finish(mpc_stream_t *s) {
+  s->finished = 1;
+}
+
+static void mpc_stream_discard(mpc_stream_t *s, size_t n, mpc_state_t *state) {
+  if (state) {
+    s->state = *state;
+  } else {
+    size_t j;
+    for (j = s->start; j < s->start + n; j++) {
+      s->state.pos++;
+      s->state.col++;
+      if (s->buffer[j] == '\n') { s->state.col = 0; s->state.row++; }
+    }
+  }
+  s->start += n;
+  if (n > 0) { s->retry = 0; }
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+/* Set when to retry a form that needs more input */
+static void mpc_stream_defer(mpc_stream_t *s) {
+  size_t n = s->length - s->start;
+  s->retry = n > MPC_STREAM_EAGER ? 2 * n : 0;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+int mpc_stream_pending(mpc_stream_t *s) {
+  size_t j;
+  for (j = s->start; j < s->length; j++) {
+    if (!isspace((unsigned char)s->buffer[j])) { return 1; }
+  }
+  return 0;
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r) {
 
-  FILE *f = fopen(filename, "rb");
-  int res;
+  int x, more;
+  size_t n = 0;
+  mpc_input_t *i;
+  mpc_state_t state;
 
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
+  r->error = NULL;
+
+  while (s->start + n < s->length
+  &&     isspace((unsigned char)s->buffer[s->start + n])) { n++; }
+  mpc_stream_discard(s, n, NULL);
+  if (s->start == s->length) { return 0; }
+  if (!s->finished && s->length - s->start < s->retry) { return 0; }
+
+  i = mpc_input_new_nstring(s->filename, s->buffer + s->start, s->length - s->start);
+  i->state = s->state;
+  i->origin = s->state;
+  i->offset = s->state.pos;
+  i->scanned = s->state.pos;
+  i->partial = !s->finished;
+
+  x = mpc_parse_input(i, s->parser, r);
+  state = i->state;
+  mpc_input_locate(i, &state);
+  more = i->exhausted && !s->finished;
+  mpc_input_delete(i);
+
+  if (x) {
+    if (more && !isspace((unsigned char)s->buffer[s->length-1])) {
+      if (s->destructor) { s->destructor(r->output); }
+      r->error = NULL;
+      mpc_stream_defer(s);
+      return 0;
+    }
+    mpc_stream_discard(s, (size_t)(state.pos - s->state.pos), &state);
+    return 1;
+  }
+
+  if (more && (!r->error || !r->error->failure)) {
+    if (r->error) { mpc_err_delete(r->error); }
+    r->error = NULL;
+    mpc_stream_defer(s);
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+  mpc_stream_discard(s, s->length - s->start, NULL);
+  return 0;
 }
 
 /*
@@ -1410,6 +2081,14 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_PACKRAT:  mpc_undefine_unretained(p->data.packrat.x, 0);  break;
+
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.trans);
+      free(p->data.dfa.accept);
+      free(p->data.dfa.live);
+      break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1495,6 +2174,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->memo = a->memo;
 
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -1518,6 +2198,17 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_PACKRAT:  p->data.packrat.x  = mpc_copy(a->data.packrat.x);  break;
+
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.trans = malloc(sizeof(unsigned short) * 256 * a->data.dfa.n);
+      memcpy(p->data.dfa.trans, a->data.dfa.trans, sizeof(unsigned short) * 256 * a->data.dfa.n);
+      p->data.dfa.accept = malloc(a->data.dfa.n);
+      memcpy(p->data.dfa.accept, a->data.dfa.accept, a->data.dfa.n);
+      p->data.dfa.live = malloc(a->data.dfa.n);
+      memcpy(p->data.dfa.live, a->data.dfa.live, a->data.dfa.n);
+      break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1874,6 +2565,33 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+/*
+** Packrat parsing memoises rules by the offset they were
+** tried at, so backtracking never runs the same rule over
+** the same input twice. FULL memoises every named rule,
+** WINDOW does the same but only keeps results from the
+** last "window" bytes, and RULES only memoises parsers
+** marked with mpc_memoize. Successes are kept by copying
+** their output with "copy" and freed again with "da"; if
+** "copy" is NULL only failures are remembered.
+*/
+
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, int policy, long window, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PACKRAT;
+  p->data.packrat.x = a;
+  p->data.packrat.policy = policy;
+  p->data.packrat.window = window;
+  p->data.packrat.copy = copy;
+  p->data.packrat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *a) {
+  a->memo = 1;
+  return a;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2350,6 +3068,523 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regular Expression DFA
+**
+** The parsers built above match a regex by walking the
+** combinators one character at a time and folding the
+** output back together. Where it can be done without
+** changing what matches, the same tree is also compiled
+** to a minimal DFA with a 256 entry transition row per
+** state, which finds the match in a single loop.
+**
+** mpc regexes behave like PEGs: choices are tried in order
+** and repetition never gives back what it took. A DFA
+** finds the longest match instead, and the two only agree
+** when every choice can be made by looking at the next
+** character. Trees with anchors or lookahead, or which
+** fail that check, are left to the combinators alone.
+*/
+
+enum {
+  MPC_RE_NODE_EPS  = 0,
+  MPC_RE_NODE_LEAF = 1,
+  MPC_RE_NODE_CAT  = 2,
+  MPC_RE_NODE_ALT  = 3,
+  MPC_RE_NODE_STAR = 4,
+  MPC_RE_NODE_PLUS = 5,
+  MPC_RE_NODE_OPT  = 6
+};
+
+enum {
+  MPC_DFA_POSITIONS_MAX = 256,
+  MPC_DFA_STATES_MAX    = 256
+};
+
+typedef struct mpc_re_node_t {
+  int type;
+  int n;
+  struct mpc_re_node_t **xs;
+  int pos;
+  int nullable;
+  int leaky;
+  unsigned char set[32];
+  unsigned char *first;
+  unsigned char *last;
+} mpc_re_node_t;
+
+#define MPC_BIT_GET(s, j) ((s)[(j) / 8] & (1 << ((j) % 8)))
+#define MPC_BIT_SET(s, j) ((s)[(j) / 8] |= (unsigned char)(1 << ((j) % 8)))
+
+static void mpc_re_bits_union(unsigned char *x, const unsigned char *y, size_t w) {
+  size_t j;
+  for (j = 0; j < w; j++) { x[j] |= y[j]; }
+}
+
+static int mpc_re_bits_meet(const unsigned char *x, const unsigned char *y, size_t w) {
+  size_t j;
+  for (j = 0; j < w; j++) { if (x[j] & y[j]) { return 1; } }
+  return 0;
+}
+
+static mpc_re_node_t *mpc_re_node_new(int type, int n) {
+  mpc_re_node_t *x = calloc(1, sizeof(mpc_re_node_t));
+  x->type = type;
+  x->n = n;
+  x->xs = n > 0 ? calloc(n, sizeof(mpc_re_node_t*)) : NULL;
+  return x;
+}
+
+static void mpc_re_node_delete(mpc_re_node_t *x) {
+  int j;
+  if (x == NULL) { return; }
+  for (j = 0; j < x->n; j++) { mpc_re_node_delete(x->xs[j]); }
+  free(x->xs);
+  free(x->first);
+  free(x->last);
+  free(x);
+}
+
+static int mpc_re_node_accepts(mpc_parser_t *p, char c) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:    return 1;
+    case MPC_TYPE_SINGLE: return c == p->data.single.x;
+    case MPC_TYPE_RANGE:  return c >= p->data.range.x && c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:  return strchr(p->data.string.x, c) != 0;
+    case MPC_TYPE_NONEOF: return strchr(p->data.string.x, c) == 0;
+    default: return 0;
+  }
+}
+
+static mpc_re_node_t *mpc_re_node_build(mpc_parser_t *p);
+
+static mpc_re_node_t *mpc_re_node_build_n(int type, int n, mpc_parser_t **ps, int step) {
+  int j;
+  mpc_re_node_t *x = mpc_re_node_new(type, n);
+  for (j = 0; j < n; j++) {
+    x->xs[j] = mpc_re_node_build(ps[j * step]);
+    if (x->xs[j] == NULL) { mpc_re_node_delete(x); return NULL; }
+  }
+  return x;
+}
+
+/*
+** Only `and` rewinds when it fails, so a count that gets
+** part way through its repetitions leaves the input moved
+** on. The match is only a plain substring if that can't
+** be seen - which means the nearest enclosing `and` has to
+** be the first thing to fail along with it.
+*/
+
+static mpc_re_node_t *mpc_re_node_leaks(mpc_re_node_t *x, int reject) {
+  if (x != NULL && reject) { mpc_re_node_delete(x); return NULL; }
+  return x;
+}
+
+static mpc_re_node_t *mpc_re_node_build(mpc_parser_t *p) {
+
+  int b, j;
+  mpc_re_node_t *x;
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT: return mpc_re_node_build(p->data.expect.x);
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      /* The end of input reads as '\0' so it is never matched */
+      x = mpc_re_node_new(MPC_RE_NODE_LEAF, 0);
+      for (b = 1; b < 256; b++) {
+        if (mpc_re_node_accepts(p, (char)b)) { MPC_BIT_SET(x->set, b); }
+      }
+      return x;
+
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_re_node_new(MPC_RE_NODE_EPS, 0);
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return NULL; }
+      x = mpc_re_node_build_n(MPC_RE_NODE_OPT, 1, &p->data.not.x, 0);
+      return mpc_re_node_leaks(x, x && x->xs[0]->leaky);
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+      x = mpc_re_node_build_n(p->type == MPC_TYPE_MANY ? MPC_RE_NODE_STAR : MPC_RE_NODE_PLUS, 1, &p->data.repeat.x, 0);
+      return mpc_re_node_leaks(x, x && x->xs[0]->leaky);
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+      if (p->data.repeat.n < 1 || p->data.repeat.n > MPC_DFA_POSITIONS_MAX) { return NULL; }
+      x = mpc_re_node_build_n(MPC_RE_NODE_CAT, p->data.repeat.n, &p->data.repeat.x, 0);
+      if (x) { x->leaky = x->n > 1 || x->xs[0]->leaky; }
+      return x;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return NULL; }
+      return mpc_re_node_build_n(MPC_RE_NODE_CAT, p->data.and.n, p->data.and.xs, 1);
+
+    case MPC_TYPE_OR:
+      x = mpc_re_node_build_n(MPC_RE_NODE_ALT, p->data.or.n, p->data.or.xs, 1);
+      if (x == NULL) { return NULL; }
+      for (j = 0; j < x->n-1; j++) {
+        if (x->xs[j]->leaky) { return mpc_re_node_leaks(x, 1); }
+      }
+      x->leaky = x->xs[x->n-1]->leaky;
+      return x;
+
+    default: return NULL;
+  }
+}
+
+/* Works out nullable and the set of first characters, numbering leaves as it goes */
+static int mpc_re_node_first(mpc_re_node_t *x, mpc_re_node_t **leaves, int *num) {
+
+  int j, prefix = 1;
+
+  for (j = 0; j < x->n; j++) {
+    if (!mpc_re_node_first(x->xs[j], leaves, num)) { return 0; }
+  }
+
+  switch (x->type) {
+    case MPC_RE_NODE_EPS: x->nullable = 1; break;
+    case MPC_RE_NODE_LEAF:
+      if (*num == MPC_DFA_POSITIONS_MAX) { return 0; }
+      x->pos = *num;
+      leaves[(*num)++] = x;
+      x->nullable = 0;
+      break;
+    case MPC_RE_NODE_CAT:
+      for (j = 0; j < x->n; j++) {
+        if (prefix) { mpc_re_bits_union(x->set, x->xs[j]->set, 32); }
+        prefix = prefix && x->xs[j]->nullable;
+      }
+      x->nullable = prefix;
+      break;
+    case MPC_RE_NODE_ALT:
+      for (j = 0; j < x->n; j++) {
+        mpc_re_bits_union(x->set, x->xs[j]->set, 32);
+        x->nullable = x->nullable || x->xs[j]->nullable;
+      }
+      break;
+    case MPC_RE_NODE_PLUS:
+      memcpy(x->set, x->xs[0]->set, 32);
+      x->nullable = x->xs[0]->nullable;
+      break;
+    case MPC_RE_NODE_STAR:
+    case MPC_RE_NODE_OPT:
+      memcpy(x->set, x->xs[0]->set, 32);
+      x->nullable = 1;
+      break;
+  }
+
+  return 1;
+}
+
+/*
+** Checks that the ordered, possessive reading of the regex
+** is the same as the longest match, given the characters
+** that can follow it. That holds when alternatives start
+** differently, only the last of them can be empty, and no
+** repetition or option can start with what comes after it.
+*/
+
+static int mpc_re_node_determined(mpc_re_node_t *x, const unsigned char *follow) {
+
+  unsigned char f[32];
+  int j, k;
+
+  switch (x->type) {
+
+    case MPC_RE_NODE_CAT:
+      memcpy(f, follow, 32);
+      for (j = x->n-1; j >= 0; j--) {
+        if (!mpc_re_node_determined(x->xs[j], f)) { return 0; }
+        if (!x->xs[j]->nullable) { memset(f, 0, 32); }
+        mpc_re_bits_union(f, x->xs[j]->set, 32);
+      }
+      return 1;
+
+    case MPC_RE_NODE_ALT:
+      for (j = 0; j < x->n; j++) {
+        if (x->xs[j]->nullable && j != x->n-1) { return 0; }
+        for (k = 0; k < j; k++) {
+          if (mpc_re_bits_meet(x->xs[j]->set, x->xs[k]->set, 32)) { return 0; }
+        }
+        if (!mpc_re_node_determined(x->xs[j], follow)) { return 0; }
+      }
+      return !(x->nullable && mpc_re_bits_meet(x->set, follow, 32));
+
+    case MPC_RE_NODE_OPT:
+      if (mpc_re_bits_meet(x->xs[0]->set, follow, 32)) { return 0; }
+      return mpc_re_node_determined(x->xs[0], follow);
+
+    case MPC_RE_NODE_STAR:
+    case MPC_RE_NODE_PLUS:
+      if (x->xs[0]->nullable) { return 0; }
+      if (mpc_re_bits_meet(x->xs[0]->set, follow, 32)) { return 0; }
+      memcpy(f, follow, 32);
+      mpc_re_bits_union(f, x->xs[0]->set, 32);
+      return mpc_re_node_determined(x->xs[0], f);
+
+    default: return 1;
+  }
+}
+
+/* Glushkov construction of the first, last and follow positions */
+static void mpc_re_node_positions(mpc_re_node_t *x, unsigned char **follow, int num) {
+
+  size_t w = (size_t)num / 8 + 1;
+  int j, p;
+  unsigned char *last;
+
+  for (j = 0; j < x->n; j++) { mpc_re_node_positions(x->xs[j], follow, num); }
+
+  x->first = calloc(w, 1);
+  x->last = calloc(w, 1);
+
+  switch (x->type) {
+
+    case MPC_RE_NODE_LEAF:
+      MPC_BIT_SET(x->first, x->pos);
+      MPC_BIT_SET(x->last, x->pos);
+      break;
+
+    case MPC_RE_NODE_CAT:
+      for (j = 0; j < x->n; j++) {
+        mpc_re_bits_union(x->first, x->xs[j]->first, w);
+        if (!x->xs[j]->nullable) { break; }
+      }
+      for (j = x->n-1; j >= 0; j--) {
+        mpc_re_bits_union(x->last, x->xs[j]->last, w);
+        if (!x->xs[j]->nullable) { break; }
+      }
+      if (x->n == 0) { break; }
+      last = calloc(w, 1);
+      memcpy(last, x->xs[0]->last, w);
+      for (j = 1; j < x->n; j++) {
+        for (p = 0; p < num; p++) {
+          if (MPC_BIT_GET(last, p)) { mpc_re_bits_union(follow[p], x->xs[j]->first, w); }
+        }
+        if (!x->xs[j]->nullable) { memset(last, 0, w); }
+        mpc_re_bits_union(last, x->xs[j]->last, w);
+      }
+      free(last);
+      break;
+
+    case MPC_RE_NODE_ALT:
+      for (j = 0; j < x->n; j++) {
+        mpc_re_bits_union(x->first, x->xs[j]->first, w);
+        mpc_re_bits_union(x->last, x->xs[j]->last, w);
+      }
+      break;
+
+    case MPC_RE_NODE_STAR:
+    case MPC_RE_NODE_PLUS:
+      for (p = 0; p < num; p++) {
+        if (MPC_BIT_GET(x->xs[0]->last, p)) { mpc_re_bits_union(follow[p], x->xs[0]->first, w); }
+      }
+      memcpy(x->first, x->xs[0]->first, w);
+      memcpy(x->last, x->xs[0]->last, w);
+      break;
+
+    case MPC_RE_NODE_OPT:
+      memcpy(x->first, x->xs[0]->first, w);
+      memcpy(x->last, x->xs[0]->last, w);
+      break;
+
+    default: break;
+  }
+}
+
+/* Moore's algorithm, leaving the dead state at 0 and the start at 1 */
+static int mpc_re_dfa_minimise(mpc_pdata_dfa_t *d) {
+
+  int *cls = malloc(sizeof(int) * d->n);
+  int *next = malloc(sizeof(int) * d->n);
+  int *reps = malloc(sizeof(int) * d->n);
+  int *map = malloc(sizeof(int) * d->n);
+  int num = 2, prev = 0, s, t, k, b, same;
+  unsigned short *trans;
+  char *accept;
+
+  for (s = 0; s < d->n; s++) { cls[s] = d->accept[s] ? 1 : 0; }
+
+  while (num != prev) {
+    prev = num;
+    num = 0;
+    for (s = 0; s < d->n; s++) {
+      for (k = 0; k < num; k++) {
+        t = reps[k];
+        if (cls[t] != cls[s]) { continue; }
+        same = 1;
+        for (b = 0; b < 256 && same; b++) {
+          same = cls[d->trans[t * 256 + b]] == cls[d->trans[s * 256 + b]];
+        }
+        if (same) { break; }
+      }
+      if (k == num) { reps[num++] = s; }
+      next[s] = k;
+    }
+    memcpy(cls, next, sizeof(int) * d->n);
+  }
+
+  /* A start state that can never match is left to the combinators */
+  if (cls[1] == cls[0]) {
+    free(cls); free(next); free(reps); free(map);
+    return 0;
+  }
+
+  for (k = 0; k < num; k++) { map[k] = -1; }
+  map[cls[0]] = 0;
+  map[cls[1]] = 1;
+  for (s = 2, k = 0; k < num; k++) {
+    if (map[k] < 0) { map[k] = s++; }
+  }
+
+  trans = calloc(256 * num, sizeof(unsigned short));
+  accept = calloc(num, 1);
+  for (k = 0; k < num; k++) {
+    s = reps[k];
+    accept[map[k]] = d->accept[s];
+    for (b = 0; b < 256; b++) {
+      trans[map[k] * 256 + b] = (unsigned short)map[cls[d->trans[s * 256 + b]]];
+    }
+  }
+
+  free(d->trans);
+  free(d->accept);
+  d->n = num;
+  d->trans = trans;
+  d->accept = accept;
+  d->live = calloc(num, 1);
+  for (s = 0; s < num; s++) {
+    for (b = 0; b < 256; b++) {
+      if (trans[s * 256 + b]) { d->live[s] = 1; break; }
+    }
+  }
+
+  free(cls); free(next); free(reps); free(map);
+  return 1;
+}
+
+/* Subset construction over the positions, state 0 being dead and 1 the start */
+static int mpc_re_dfa_build(mpc_pdata_dfa_t *d, mpc_re_node_t *root, mpc_re_node_t **leaves, unsigned char **follow, int num) {
+
+  size_t w = (size_t)num / 8 + 1;
+  int k, s, b, p, ok = 1;
+  unsigned char *sets = calloc(MPC_DFA_STATES_MAX, w);
+  unsigned char *cands = calloc(w, 1);
+  unsigned char *next = calloc(256, w);
+
+  d->n = 2;
+  d->trans = calloc(256 * MPC_DFA_STATES_MAX, sizeof(unsigned short));
+  d->accept = calloc(MPC_DFA_STATES_MAX, 1);
+  d->live = NULL;
+  d->accept[1] = (char)root->nullable;
+
+  for (k = 1; k < d->n && ok; k++) {
+
+    if (k == 1) {
+      memcpy(cands, root->first, w);
+    } else {
+      memset(cands, 0, w);
+      for (p = 0; p < num; p++) {
+        if (MPC_BIT_GET(sets + k * w, p)) { mpc_re_bits_union(cands, follow[p], w); }
+      }
+      d->accept[k] = (char)mpc_re_bits_meet(sets + k * w, root->last, w);
+    }
+
+    memset(next, 0, 256 * w);
+    for (p = 0; p < num; p++) {
+      if (!MPC_BIT_GET(cands, p)) { continue; }
+      for (b = 1; b < 256; b++) {
+        if (MPC_BIT_GET(leaves[p]->set, b)) { MPC_BIT_SET(next + b * w, p); }
+      }
+    }
+
+    for (b = 1; b < 256; b++) {
+      if (!mpc_re_bits_meet(next + b * w, next + b * w, w)) { continue; }
+      if (b > 1 && memcmp(next + b * w, next + (b-1) * w, w) == 0) {
+        d->trans[k * 256 + b] = d->trans[k * 256 + b - 1];
+        continue;
+      }
+      for (s = 2; s < d->n; s++) {
+        if (memcmp(sets + s * w, next + b * w, w) == 0) { break; }
+      }
+      if (s == d->n) {
+        if (d->n == MPC_DFA_STATES_MAX) { ok = 0; break; }
+        memcpy(sets + s * w, next + b * w, w);
+        d->n++;
+      }
+      d->trans[k * 256 + b] = (unsigned short)s;
+    }
+  }
+
+  free(sets);
+  free(cands);
+  free(next);
+
+  if (!ok || !mpc_re_dfa_minimise(d)) {
+    free(d->trans);
+    free(d->accept);
+    return 0;
+  }
+
+  return 1;
+}
+
+#undef MPC_BIT_GET
+#undef MPC_BIT_SET
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a) {
+
+  mpc_re_node_t *leaves[MPC_DFA_POSITIONS_MAX];
+  unsigned char **follow;
+  unsigned char none[32];
+  mpc_re_node_t *root;
+  mpc_pdata_dfa_t d;
+  mpc_parser_t *p = NULL;
+  size_t w;
+  int num = 0, j;
+
+  root = mpc_re_node_build(a);
+  if (root == NULL) { return a; }
+  if (root->leaky) {
+    mpc_re_node_delete(root);
+    return a;
+  }
+
+  memset(none, 0, 32);
+  if (!mpc_re_node_first(root, leaves, &num)
+  ||  !mpc_re_node_determined(root, none)) {
+    mpc_re_node_delete(root);
+    return a;
+  }
+
+  w = (size_t)num / 8 + 1;
+  follow = malloc(sizeof(unsigned char*) * (num + 1));
+  for (j = 0; j < num; j++) { follow[j] = calloc(w, 1); }
+  mpc_re_node_positions(root, follow, num);
+
+  if (mpc_re_dfa_build(&d, root, leaves, follow, num)) {
+    p = mpc_undefined();
+    p->type = MPC_TYPE_DFA;
+    p->data.dfa = d;
+    p->data.dfa.x = a;
+  }
+
+  for (j = 0; j < num; j++) { free(follow[j]); }
+  free(follow);
+  mpc_re_node_delete(root);
+
+  return p ? p : a;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2417,7 +3652,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_re_dfa(r.output);
 
 }
 
@@ -2769,6 +4004,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_print_unretained(p->data.packrat.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -3007,6 +4244,25 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   return a;
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return a; }
+
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return b;
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   int i;
@@ -3332,6 +4588,10 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+mpc_parser_t *mpca_packrat(mpc_parser_t *a, int policy, long window) {
+  return mpc_packrat(a, policy, window, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+}
+
 /*
 ** Grammar Parser
 */
@@ -3855,6 +5115,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { return 1 + mpc_nodecount_unretained(p->data.packrat.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3907,6 +5169,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)    { mpc_optimise_unretained(p->data.packrat.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
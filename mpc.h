@@ -85,6 +85,20 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
 
+/*
+** Streaming
+*/
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_stream_delete(mpc_stream_t *s);
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length);
+void mpc_stream_finish(mpc_stream_t *s);
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r);
+int mpc_stream_pending(mpc_stream_t *s);
+
 /*
 ** Building a Parser
 */
@@ -148,6 +162,19 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Packrat Parsing
+*/
+
+enum {
+  MPC_PACKRAT_FULL   = 0,
+  MPC_PACKRAT_WINDOW = 1,
+  MPC_PACKRAT_RULES  = 2
+};
+
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, int policy, long window, mpc_apply_t copy, mpc_dtor_t da);
+mpc_parser_t *mpc_memoize(mpc_parser_t *a);
+
 /*
 ** Common Parsers
 */
@@ -297,6 +324,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -340,6 +368,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_packrat(mpc_parser_t *a, int policy, long window);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
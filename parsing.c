@@ -1,6 +1,12 @@
+// mmap and getpid for the JIT and clock_gettime for the collector
+// are POSIX rather than C99
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include "mpc.h"
 
 //if we are compiling on windows compile these functions
@@ -15,7 +21,7 @@ char* readline(char* prompt) {
     char* cpy = malloc(strlen(buffer)+1);
     strcpy(cpy, buffer);
     cpy[strlen(cpy)-1] = '\0';
-    return cpy
+    return cpy;
 }
 
 // fake add_history function
@@ -36,7 +42,7 @@ void add_history(char* unused) {}
 #define LASSERT_TYPE(func, args, index, expect) \
     LASSERT(args, args->cell[index]->type == expect, \
             "Function '%s' passed incorrect type for argument %i " \
-            "Got %s, Expected %s." \
+            "Got %s, Expected %s.", \
             func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
@@ -53,13 +59,24 @@ void add_history(char* unused) {}
 //Forward Declarations
 struct lval;
 struct lenv;
+struct lmap;
+struct lrope;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmap lmap;
+typedef struct lrope lrope;
 
 // Lisp Value
 
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN,
-    LVAL_SEXPR, LVAL_QEXPR };
+    LVAL_SEXPR, LVAL_QEXPR, LVAL_DBL, LVAL_VEC, LVAL_MAP, LVAL_SET,
+    LVAL_STR };
+
+// Strings shorter than this are stored inside the lval itself
+enum { LSTR_INLINE = 23 };
+
+// Element storage of a packed vector
+enum { LVEC_INT, LVEC_FLT };
 
 typedef lval* (*lbuiltin) (lenv*, lval*);
 
@@ -68,35 +85,506 @@ struct lval {
 
     // basic
     long long num;
+    double dbl;
     char* err;
     char* sym;
 
+    // global inline cache cell of a symbol read from source, 0 for none
+    int ic;
+
+    // type feedback slot of an arithmetic expression, 0 for none
+    int site;
+
     //function
     lbuiltin builtin;
     lenv* env;
     lval* formals;
     lval* body;
+    int noescape;
+
+    // JIT slot of a lambda bound globally, 0 for none
+    int jit;
 
     // Expression
     int count;
     lval** cell;
+
+    // Vector (length is kept in count)
+    int vkind;
+    void* vdata;
+
+    // Map or Set
+    lmap* map;
+
+    // String (either inline in sbuf or in a rope)
+    long slen;
+    char sbuf[LSTR_INLINE];
+    lrope* rope;
+
+    // Hash-consing: interned values are shared and must not be mutated
+    int interned;
+    int refs;
+
+    // Allocated from the live arena rather than the heap
+    int arena;
+};
+
+// Hash table behind maps and sets. Entries are kept densely in
+// insertion order and found through an open addressing index of
+// entry positions, so probing touches one small array and iteration
+// order is stable. Removed entries keep their slot with key NULL until
+// the next rebuild. Sets leave 'vals' NULL.
+struct lmap {
+    int arena;
+    int count;
+    int used;
+    int slots;
+    int* index;
+    unsigned long long* hashes;
+    lval** keys;
+    lval** vals;
+};
+
+// A rope is either a leaf holding 'data' or a concatenation of
+// 'left' and 'right'. Nodes are shared and never modified.
+struct lrope {
+    int refs;
+    int depth;
+    long len;
+    lrope* left;
+    lrope* right;
+    char* data;
 };
 
 struct lenv{
+    int arena;
     lenv* par;
     int count;
     char** syms;
     lval** vals;
+
+    // Pooled call frame, see lframe_push
+    int frame;
+    int slots;
 };
 
+// Stack of things waiting to be freed by the sweeper, see lsweep_step
+enum { LSWEEP_LVAL, LSWEEP_ROPE, LSWEEP_ENV, LSWEEP_MAP, LSWEEP_CHUNK };
+
+typedef struct {
+    long num;
+    long slots;
+    void** items;
+    char* kinds;
+} lsweep_t;
+
+lsweep_t lsweep = { 0, 0, NULL, NULL };
+
+void lsweep_push(int kind, void* p) {
+    if (lsweep.num == lsweep.slots) {
+        lsweep.slots = lsweep.slots ? lsweep.slots * 2 : 256;
+        lsweep.items = realloc(lsweep.items, sizeof(void*) * lsweep.slots);
+        lsweep.kinds = realloc(lsweep.kinds, lsweep.slots);
+    }
+    lsweep.items[lsweep.num] = p;
+    lsweep.kinds[lsweep.num] = kind;
+    lsweep.num++;
+}
+
+// Arenas
+//
+// Each top-level expression is evaluated with an arena as the current
+// space. Everything the evaluator creates is bump allocated from it and
+// released in one go once the result has been printed, rather than
+// being freed node by node. Values that escape into a heap environment
+// through lenv_put are copied out to the heap first.
+//
+// Arena memory is never owned by heap values. Ropes and interned
+// values are reference counted heap objects though, so whenever an
+// arena value takes a reference to one the arena records it and drops
+// it on release. Deleting an arena value is therefore a no-op.
+
+enum { LARENA_CHUNK = 256 * 1024 };
+
+enum { LHOLD_LVAL, LHOLD_ROPE, LHOLD_JIT };
+
+typedef struct larena_chunk {
+    struct larena_chunk* next;
+    size_t size;
+    char data[];
+} larena_chunk;
+
+typedef struct {
+    larena_chunk* chunks;
+    char* ptr;
+    char* end;
+    char* last;
+    size_t allocated;
+
+    int held_num;
+    int held_slots;
+    void** held;
+    char* held_kinds;
+} larena;
+
+// Arena of the expression being evaluated, if any
+larena* larena_live = NULL;
+
+// Whether new values go into the live arena rather than the heap
+int lspace_arena = 0;
+
+// Switch between allocating from the heap (0) and the arena (1),
+// returning the previous setting so it can be restored
+int lspace_set(int arena) {
+    int prev = lspace_arena;
+    lspace_arena = arena && larena_live;
+    return prev;
+}
+
+// Oversized blocks get a chunk with room to double, so that a block
+// being grown by larena_realloc keeps growing in place
+void larena_chunk_new(larena* a, size_t n) {
+    size_t size = n > LARENA_CHUNK / 2 ? 2 * n : LARENA_CHUNK;
+    larena_chunk* c = malloc(sizeof(larena_chunk) + size);
+    c->next = a->chunks;
+    c->size = size;
+    a->chunks = c;
+    a->ptr = c->data;
+    a->end = c->data + size;
+}
+
+larena* larena_new(void) {
+    larena* a = malloc(sizeof(larena));
+    a->chunks = NULL;
+    a->last = NULL;
+    a->allocated = 0;
+    a->held_num = 0;
+    a->held_slots = 0;
+    a->held = NULL;
+    a->held_kinds = NULL;
+    larena_chunk_new(a, LARENA_CHUNK);
+    return a;
+}
+
+// Each block is preceded by its size so that it can be reallocated
+void* larena_alloc(larena* a, size_t n) {
+    size_t need = sizeof(size_t) + ((n + 7) & ~(size_t)7);
+    if (a->ptr + need > a->end) { larena_chunk_new(a, need); }
+    *(size_t*)a->ptr = n;
+    a->last = a->ptr + sizeof(size_t);
+    a->ptr += need;
+    a->allocated += need;
+    return a->last;
+}
+
+void* larena_realloc(larena* a, void* p, size_t n) {
+    if (!p) { return larena_alloc(a, n); }
+    size_t* size = (size_t*)p - 1;
+    if (n <= *size) { return p; }
+
+    // the most recent block can simply grow in place
+    size_t need = (n + 7) & ~(size_t)7;
+    if (p == a->last && (char*)p + need <= a->end) {
+        a->allocated += need - ((*size + 7) & ~(size_t)7);
+        *size = n;
+        a->ptr = (char*)p + need;
+        return p;
+    }
+
+    // otherwise the block moves, and at least doubles so that one grown
+    // an element at a time between other allocations is copied only a
+    // logarithmic number of times
+    void* q = larena_alloc(a, n > 2 * *size ? n : 2 * *size);
+    memcpy(q, p, *size);
+    return q;
+}
+
+// Record a reference held by an arena value, to be dropped on release
+void larena_hold(larena* a, int kind, void* p) {
+    if (a->held_num == a->held_slots) {
+        a->held_slots = a->held_slots ? a->held_slots * 2 : 64;
+        a->held = realloc(a->held, sizeof(void*) * a->held_slots);
+        a->held_kinds = realloc(a->held_kinds, a->held_slots);
+    }
+    a->held[a->held_num] = p;
+    a->held_kinds[a->held_num] = kind;
+    a->held_num++;
+}
+
+void* lmem_alloc(int arena, size_t n) {
+    return arena ? larena_alloc(larena_live, n) : malloc(n);
+}
+
+void* lmem_realloc(int arena, void* p, size_t n) {
+    return arena ? larena_realloc(larena_live, p, n) : realloc(p, n);
+}
+
+void lmem_free(int arena, void* p) {
+    if (!arena) { free(p); }
+}
+
+void lval_del(lval* v);
+void lrope_unref(lrope* r);
+void ljit_unref(int jit);
+
+void larena_drop(int kind, void* p) {
+    switch (kind) {
+        case LHOLD_LVAL: lval_del(p); break;
+        case LHOLD_ROPE: lrope_unref(p); break;
+        case LHOLD_JIT: ljit_unref((int)(size_t)p); break;
+    }
+}
+
+// Drop everything allocated since the arena was started
+void larena_release(larena* a) {
+    int prev = lspace_set(0);
+    for (int i = 0; i < a->held_num; i++) {
+        larena_drop(a->held_kinds[i], a->held[i]);
+    }
+    a->held_num = 0;
+    lspace_set(prev);
+
+    // keep the first chunk around for the next expression
+    while (a->chunks->next) {
+        larena_chunk* c = a->chunks;
+        a->chunks = c->next;
+        lsweep_push(LSWEEP_CHUNK, c);
+    }
+    a->ptr = a->chunks->data;
+    a->end = a->chunks->data + a->chunks->size;
+    a->last = NULL;
+    a->allocated = 0;
+}
+
+// Free an arena that is no longer live, with everything it still holds
+void larena_delete(larena* a) {
+    larena_release(a);
+    free(a->chunks);
+    free(a->held);
+    free(a->held_kinds);
+    free(a);
+}
+
+// Start allocating from arena 'a'
+void larena_begin(larena* a) {
+    larena_live = a;
+    lspace_set(1);
+}
+
+// Stop allocating from the live arena and release it
+void larena_end(void) {
+    larena* a = larena_live;
+    lspace_set(0);
+    larena_live = NULL;
+    larena_release(a);
+}
+
+// A position in the live arena that it can later be rewound to
+typedef struct {
+    larena_chunk* chunk;
+    char* ptr;
+    int held_num;
+} larena_mark_t;
+
+larena_mark_t larena_mark(larena* a) {
+    larena_mark_t m = { a->chunks, a->ptr, a->held_num };
+    return m;
+}
+
+// Release everything allocated after mark 'm'. Only safe when nothing
+// allocated before the mark has been made to point past it.
+void larena_rewind(larena* a, larena_mark_t m) {
+    int prev = lspace_set(0);
+    for (int i = m.held_num; i < a->held_num; i++) {
+        larena_drop(a->held_kinds[i], a->held[i]);
+    }
+    a->held_num = m.held_num;
+    lspace_set(prev);
+
+    while (a->chunks != m.chunk) {
+        larena_chunk* c = a->chunks;
+        a->chunks = c->next;
+        lsweep_push(LSWEEP_CHUNK, c);
+    }
+    a->ptr = m.ptr;
+    a->end = m.chunk->data + m.chunk->size;
+    a->last = NULL;
+}
+
+// Put the chunks and held references of arena 'b' on top of those of
+// 'a', which carries on allocating from where 'b' stopped
+void larena_splice(larena* a, larena* b) {
+    larena_chunk* c = b->chunks;
+    while (c->next) { c = c->next; }
+    c->next = a->chunks;
+    a->chunks = b->chunks;
+    a->ptr = b->ptr;
+    a->end = b->end;
+    a->last = NULL;
+    a->allocated += b->allocated;
+
+    for (int i = 0; i < b->held_num; i++) {
+        larena_hold(a, b->held_kinds[i], b->held[i]);
+    }
+    free(b->held);
+    free(b->held_kinds);
+}
+
+// Generations
+//
+// The arena is the nursery of a two generation collector and the heap
+// is the old space. Young values are bump allocated, and survive only
+// by being evacuated:
+//
+//  - A minor collection runs when a lambda call returns after the
+//    nursery has grown by more than its size since the last one. The
+//    result is the only live value the call allocated, so it is copied
+//    out, everything from the start of the call is dropped, and the
+//    copy is spliced back in as the new top of the nursery.
+//  - Storing into a heap environment goes through the write barrier
+//    in lenv_put, which promotes the value by copying it to the heap.
+//    Old values never point into the nursery.
+//  - When the top-level expression is done the nursery is reset.
+//  - Old values are reclaimed incrementally by the sweeper, in a slice
+//    after each top-level expression and a few steps at every lambda
+//    return.
+//
+// Pauses are bounded by the size of what survives rather than by what
+// was allocated, so the nursery size trades collection frequency
+// against the memory a long running expression can hold on to.
+
+enum { LGC_NURSERY = 1024 * 1024, LGC_MAX_PAUSE = 1000 };
+
+// Pause histogram buckets, bucket 'i' counting pauses shorter than
+// 2^(i+1) microseconds and the last everything longer
+enum { LGC_BUCKETS = 16 };
+
+typedef struct {
+    size_t nursery;
+    size_t next;
+    double max_pause;
+    long minor;
+    size_t survived;
+    long promoted;
+    long pauses;
+    double pause_max;
+    double pause_total;
+    long hist[LGC_BUCKETS];
+} lgc_t;
+
+lgc_t lgc = { LGC_NURSERY, LGC_NURSERY, LGC_MAX_PAUSE };
+
+// Sweeper steps taken at every lambda return
+enum { LSWEEP_STEPS = 8 };
+
+void lsweep_run(long steps, double until);
+
+// Current wall clock time in microseconds. Process CPU time would also
+// count the work of the reader and printer threads.
+double lgc_now(void) {
+#ifdef _WIN32
+    return (double)clock() * 1e6 / CLOCKS_PER_SEC;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+#endif
+}
+
+void lgc_pause(double start) {
+    double t = lgc_now() - start;
+    lgc.pauses++;
+    lgc.pause_total += t;
+    if (t > lgc.pause_max) { lgc.pause_max = t; }
+
+    int b = 0;
+    while (b < LGC_BUCKETS - 1 && t >= (double)(2L << b)) { b++; }
+    lgc.hist[b]++;
+}
+
+// Start evaluating a top-level expression with 'a' as the nursery
+void lgc_begin(larena* a) {
+    larena_begin(a);
+    lgc.next = lgc.nursery;
+}
+
+// Throw away the nursery once the expression's result is printed, and
+// spend what is left of the pause budget sweeping
+void lgc_end(void) {
+    double start = lgc_now();
+    larena_end();
+    lsweep_run(-1, start + lgc.max_pause);
+    lgc_pause(start);
+}
+
+lval* lval_copy(lval* v);
+
+// Collect the nursery back to mark 'm' keeping only 'r', if due
+lval* lgc_minor(larena_mark_t m, lval* r) {
+    larena* a = larena_live;
+    lsweep_run(LSWEEP_STEPS, 0);
+    if (a->allocated < lgc.next) { return r; }
+    double start = lgc_now();
+
+    // evacuate into a to-space before the from-space is dropped
+    larena to = { NULL, NULL, NULL, NULL, 0, 0, 0, NULL, NULL };
+    larena_chunk_new(&to, LARENA_CHUNK);
+    larena_live = &to;
+    lval* x = lval_copy(r);
+    larena_live = a;
+
+    larena_rewind(a, m);
+    larena_splice(a, &to);
+
+    // give large survivors room before they get copied again
+    lgc.minor++;
+    lgc.survived += to.allocated;
+    size_t room = 2 * to.allocated;
+    lgc.next = a->allocated + (room > lgc.nursery ? room : lgc.nursery);
+
+    lgc_pause(start);
+    return x;
+}
+
 // Create Enumeration of Possible Error Types
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
 lenv* lenv_new(void);
 
+// Every lval is allocated here so that all fields shared by the
+// different types start out in a known state
+lval* lval_new(int type) {
+    lval* v = lmem_alloc(lspace_arena, sizeof(lval));
+    v->type = type;
+    v->interned = 0;
+    v->refs = 1;
+    v->arena = lspace_arena;
+    v->ic = 0;
+    v->site = 0;
+    v->jit = 0;
+    return v;
+}
+
+// Escape analysis
+//
+// A call frame can only outlive its call if some function value made
+// while the call runs holds on to it. Lambdas here start out with an
+// empty environment of their own instead of capturing the frame they
+// are made in, so this is really a guard: a body that can create no
+// function values at all, because it never mentions the lambda
+// builtin, is proven not to let its frame escape.
+int lval_noescape(lval* body) {
+    if (body->type == LVAL_SYM) { return strcmp(body->sym, "\\") != 0; }
+    if (body->type == LVAL_SEXPR || body->type == LVAL_QEXPR) {
+        for (int i = 0; i < body->count; i++) {
+            if (!lval_noescape(body->cell[i])) { return 0; }
+        }
+    }
+    return 1;
+}
+
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_new(LVAL_FUN);
 
     //set builtin to null
     v->builtin = NULL;
@@ -107,35 +595,53 @@ lval* lval_lambda(lval* formals, lval* body) {
     //set formals and body
     v->formals = formals;
     v->body = body;
+    v->noescape = lval_noescape(body);
     return v;
 }
 
 // Construct a pointer to a new number lval
 lval* lval_num(long long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 
+// Construct a pointer to a new floating point lval
+lval* lval_dbl(double x) {
+    lval* v = lval_new(LVAL_DBL);
+    v->dbl = x;
+    return v;
+}
+
+// Construct a pointer to a new packed vector of n uninitialised elements
+lval* lval_vec(int kind, int n) {
+    lval* v = lval_new(LVAL_VEC);
+    v->vkind = kind;
+    v->count = n;
+    v->vdata = lmem_alloc(v->arena, (n ? n : 1) *
+        (kind == LVEC_INT ? sizeof(long long) : sizeof(double)));
+    return v;
+}
+
 // Construct a pointer to a new error lval
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lval_new(LVAL_ERR);
 
     // create a va list and initialize it
     va_list va;
     va_start(va, fmt);
 
     // allocate 512 bytes of space
-    v->err = malloc(512 * sizeof(char));
+    v->err = lmem_alloc(v->arena, 512 * sizeof(char));
 
     //printf the error string with a maximum of 511 characters
     vsnprintf(v->err, 511, fmt, va);
 
     // reallocate to number of bytes actually used
-    v->err = realloc(v->err, (strlen(v->err) + 1) * sizeof(char));
+    if (!v->arena) {
+        v->err = realloc(v->err, (strlen(v->err) + 1) * sizeof(char));
+    }
 
     //cleanup our va_list
     va_end(va);
@@ -145,24 +651,21 @@ lval* lval_err(char* fmt, ...) {
 
 // Construct a pointer to a new symbol lval
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) * sizeof(char) + 1);
+    lval* v = lval_new(LVAL_SYM);
+    v->sym = lmem_alloc(v->arena, strlen(s) * sizeof(char) + 1);
     strcpy(v->sym, s);
     return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->fun = func;
+    lval* v = lval_new(LVAL_FUN);
+    v->builtin = func;
     return v;
 }
 
 // Construct a poiter to a new sexpr lval
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_new(LVAL_SEXPR);
     v->count = 0;
     v->cell = NULL;
     return v;
@@ -170,66 +673,187 @@ lval* lval_sexpr(void) {
 
 // Constructs a pointer to a new qexpr lval
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_new(LVAL_QEXPR);
     v->count = 0;
     v->cell = NULL;
     return v;
 }
 
 void lenv_del(lenv* e);
-
-void lval_del(lval* v) {
-
-    switch (v->type) {
-        // Do nothing special for number or func type
-        case LVAL_NUM: break;
-        case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+void lmap_del(lmap* m);
+void lhc_remove(lval* v);
+
+// Sweeping
+//
+// Heap values are not freed by lval_del itself. Once the last reference
+// is dropped the value is pushed onto the sweep stack, and the sweeper
+// later releases it one step at a time: a step frees a single child,
+// map entry, binding or node. Dropping a structure of any size is
+// therefore constant work for the caller, and the sweeper can be run
+// in slices bounded by time or by steps. Chunks of released arenas go
+// the same way.
+
+void lval_del(lval* v);
+void lrope_unref(lrope* r);
+void lenv_del(lenv* e);
+void lmap_del(lmap* m);
+void lspec_site_unref(int site);
+
+// Take one step on the item at the top of the sweep stack. Items stay
+// on the stack until all their children have been released.
+void lsweep_step(void) {
+    void* p = lsweep.items[lsweep.num - 1];
+    switch (lsweep.kinds[lsweep.num - 1]) {
+        case LSWEEP_LVAL: {
+            lval* v = p;
+            if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count) {
+                lval_del(v->cell[--v->count]);
+                return;
             }
-            break;
+            lsweep.num--;
+            switch (v->type) {
+                case LVAL_VEC: free(v->vdata); break;
+                case LVAL_MAP:
+                case LVAL_SET: lmap_del(v->map); break;
+                case LVAL_STR: lrope_unref(v->rope); break;
+                case LVAL_FUN:
+                    if (!v->builtin) {
+                        lenv_del(v->env);
+                        lval_del(v->formals);
+                        lval_del(v->body);
+                        ljit_unref(v->jit);
+                    }
+                    break;
+                case LVAL_ERR: free(v->err); break;
+                case LVAL_SYM: free(v->sym); break;
+                case LVAL_QEXPR:
+                case LVAL_SEXPR:
+                    lspec_site_unref(v->site);
+                    free(v->cell);
+                    break;
+            }
+            free(v);
+            return;
+        }
+        case LSWEEP_ROPE: {
+            lrope* r = p;
+            lsweep.num--;
+            lrope_unref(r->left);
+            lrope_unref(r->right);
+            free(r->data);
+            free(r);
+            return;
+        }
+        case LSWEEP_ENV: {
+            lenv* e = p;
+            if (e->count) {
+                e->count--;
+                free(e->syms[e->count]);
+                lval_del(e->vals[e->count]);
+                return;
+            }
+            lsweep.num--;
+            free(e->syms);
+            free(e->vals);
+            free(e);
+            return;
+        }
+        case LSWEEP_MAP: {
+            lmap* m = p;
+            if (m->used) {
+                m->used--;
+                if (m->keys[m->used]) {
+                    lval_del(m->keys[m->used]);
+                    if (m->vals) { lval_del(m->vals[m->used]); }
+                }
+                return;
+            }
+            lsweep.num--;
+            free(m->index);
+            free(m->hashes);
+            free(m->keys);
+            free(m->vals);
+            free(m);
+            return;
+        }
+        case LSWEEP_CHUNK:
+            lsweep.num--;
+            free(p);
+            return;
+    }
+}
+
+// Sweep for at most 'steps' steps if it is not negative, and until
+// time 'until' if it is not zero, checking the clock every so often
+void lsweep_run(long steps, double until) {
+    if (!lsweep.num) { return; }
+    int prev = lspace_set(0);
+    for (long i = 0; lsweep.num && i != steps; i++) {
+        if (until && (i & 255) == 255 && lgc_now() >= until) { break; }
+        lsweep_step();
+    }
+    lspace_set(prev);
+}
 
-                       // For Err or Sym free the string data
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+void lval_del(lval* v) {
 
-                       // If Sexpr or Qexpr then delete all elements inside
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-                       for (int i = 0; i < v->count; i++) {
-                           lval_del(v->cell[i]);
-                       }
+    // Arena values and the references they hold go with their arena
+    if (v->arena) { return; }
 
-                       // also free the memory allocated to contain the pointers
-                       free(v->cell);
-                       break;
+    // Interned values are shared, only the last reference frees them.
+    // While evaluating into an arena every reference the evaluator
+    // holds is owned by the arena, so it is left for the arena to drop.
+    if (v->interned) {
+        if (lspace_arena) { return; }
+        if (--v->refs > 0) { return; }
+        lhc_remove(v);
     }
 
-    // also free the memory allocated from the "lval" struct itself
-    free(v);
+    // the memory itself is released by the sweeper
+    lsweep_push(LSWEEP_LVAL, v);
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
     errno = 0;
+    if (strchr(t->contents, '.')) {
+        double d = strtod(t->contents, NULL);
+        return errno != ERANGE ? lval_dbl(d) : lval_err("invalid number");
+    }
     long long x = strtoll(t->contents, NULL, 10);
     return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
 }
 
+lval* lval_str(const char* s);
+
+lval* lval_read_str(mpc_ast_t* t) {
+    // the string literal parser has already stripped the quotes
+    char* unescaped = malloc(strlen(t->contents) + 1);
+    strcpy(unescaped, t->contents);
+    unescaped = mpcf_unescape(unescaped);
+    lval* str = lval_str(unescaped);
+    free(unescaped);
+    return str;
+}
+
 lval* lval_add(lval* v, lval*x) {
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell = lmem_realloc(v->arena, v->cell, sizeof(lval*) * v->count);
     v->cell[v->count-1] = x;
     return v;
 }
 
+int lic_cell(char* s);
+
 lval* lval_read(mpc_ast_t* t) {
 
     //if symbol or number, return conversion to that type
+    if (strstr(t->tag, "string")) {return lval_read_str(t);}
     if (strstr(t->tag, "number")) {return lval_read_num(t);}
-    if (strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
+    if (strstr(t->tag, "symbol")) {
+        lval* x = lval_sym(t->contents);
+        x->ic = lic_cell(x->sym);
+        return x;
+    }
 
     //if root (>) or sexpr then create empty list
     lval* x = NULL;
@@ -251,16 +875,44 @@ lval* lval_read(mpc_ast_t* t) {
 }
 
 lenv* lenv_copy(lenv* e);
+lmap* lmap_copy(lmap* m);
+void lval_str_hold(lval* v);
+int lspec_site_ref(int site, int arena);
+int ljit_ref(int jit, int arena);
 
 lval* lval_copy(lval* v) {
 
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+    // Interned values are immutable so a copy can share them
+    if (v->interned) {
+        v->refs++;
+        if (lspace_arena) { larena_hold(larena_live, LHOLD_LVAL, v); }
+        return v;
+    }
+
+    lval* x = lval_new(v->type);
 
     switch (v->type) {
 
         //Copy functions and numbers directly
         case LVAL_NUM: x->num = v->num; break;
+        case LVAL_DBL: x->dbl = v->dbl; break;
+        case LVAL_VEC: {
+            size_t size = (v->count ? v->count : 1) *
+                (v->vkind == LVEC_INT ? sizeof(long long) : sizeof(double));
+            x->vkind = v->vkind;
+            x->count = v->count;
+            x->vdata = lmem_alloc(x->arena, size);
+            memcpy(x->vdata, v->vdata, size);
+        }
+        break;
+        case LVAL_MAP:
+        case LVAL_SET: x->map = lmap_copy(v->map); break;
+        case LVAL_STR:
+            x->slen = v->slen;
+            memcpy(x->sbuf, v->sbuf, LSTR_INLINE);
+            x->rope = v->rope;
+            if (x->rope) { lval_str_hold(x); }
+            break;
         case LVAL_FUN:
             if (v->builtin) {
                 x->builtin = v->builtin;
@@ -270,23 +922,27 @@ lval* lval_copy(lval* v) {
                 x->env = lenv_copy(v->env);
                 x->formals = lval_copy(v->formals);
                 x->body = lval_copy(v->body);
+                x->noescape = v->noescape;
+                x->jit = ljit_ref(v->jit, x->arena);
             }
             break;
         //Copy strings using malloc and strcpy
         case LVAL_ERR:
-            x->err = malloc((strlen(v->err) + 1) * sizeof(char));
+            x->err = lmem_alloc(x->arena, (strlen(v->err) + 1) * sizeof(char));
             strcpy(x->err, v->err); break;
 
         case LVAL_SYM:
-            x->sym = malloc((strlen(v->sym) + 1) * sizeof(char));
+            x->sym = lmem_alloc(x->arena, (strlen(v->sym) + 1) * sizeof(char));
             strcpy(x->sym, v->sym);
+            x->ic = v->ic;
             break;
 
         // Copy lists by copying each sub expression
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * v->count);
+            x->site = lspec_site_ref(v->site, x->arena);
+            x->cell = lmem_alloc(x->arena, sizeof(lval*) * v->count);
             for (int i = 0; i < v->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
@@ -296,559 +952,4232 @@ lval* lval_copy(lval* v) {
     return x;
 }
 
-void lval_print(lval* v);
-void lval_expr_print(lval* v, char open, char close);
+// Ropes
+//
+// Strings too long to be stored inline in their lval live in a rope.
+// Rope nodes are immutable and reference counted, so copying a string
+// is O(1). Concatenation joins trees the way AVL trees are joined,
+// copying only the nodes along one spine and rotating on the way back
+// up, so repeated joins stay O(log n) and the tree stays balanced.
+// Small adjacent leaves are merged to keep the leaf count down.
+
+enum { LROPE_LEAF = 256 };
+
+lrope* lrope_leaf(const char* s, long n) {
+    lrope* r = malloc(sizeof(lrope));
+    r->refs = 1;
+    r->len = n;
+    r->depth = 0;
+    r->left = NULL;
+    r->right = NULL;
+    r->data = malloc(n + 1);
+    memcpy(r->data, s, n);
+    r->data[n] = '\0';
+    return r;
+}
 
-void lval_print (lval* v) {
-    switch(v->type) {
-        case LVAL_NUM: printf("%lli", v->num); break;
-        case LVAL_ERR: printf("Error: %s", v->err); break;
-        case LVAL_FUN:
-            if (v->builtin) {
-                printf("<builtin>");
-            } else {
-                printf("(\\ "); lval_print(v->formals);
-                putchar(' '); lval_print(v->body); putchar(')');
-            }
-        break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-    }
+void lrope_unref(lrope* r) {
+    if (r && --r->refs == 0) { lsweep_push(LSWEEP_ROPE, r); }
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
+// Make a concatenation node, taking the references to 'l' and 'r'
+lrope* lrope_node(lrope* l, lrope* r) {
+    lrope* n = malloc(sizeof(lrope));
+    n->refs = 1;
+    n->len = l->len + r->len;
+    n->depth = 1 + (l->depth > r->depth ? l->depth : r->depth);
+    n->left = l;
+    n->right = r;
+    n->data = NULL;
+    return n;
+}
 
-        //Print Value contained within
-        lval_print(v->cell[i]);
+// Take new references to the children of 'r' and drop the one to 'r'
+void lrope_open(lrope* r, lrope** l, lrope** rr) {
+    *l = r->left; (*l)->refs++;
+    *rr = r->right; (*rr)->refs++;
+    lrope_unref(r);
+}
 
-        //don't print trailing space for the last element
-        if (i != (v->count-1)) {
-            putchar(' ');
+// Join two subtrees whose depths differ by at most two
+lrope* lrope_balance(lrope* l, lrope* r) {
+    lrope *a, *b, *c, *d;
+    if (r->depth > l->depth + 1) {
+        lrope_open(r, &a, &b);
+        if (b->depth >= a->depth) {
+            return lrope_node(lrope_node(l, a), b);
+        }
+        lrope_open(a, &c, &d);
+        return lrope_node(lrope_node(l, c), lrope_node(d, b));
+    }
+    if (l->depth > r->depth + 1) {
+        lrope_open(l, &a, &b);
+        if (a->depth >= b->depth) {
+            return lrope_node(a, lrope_node(b, r));
         }
+        lrope_open(b, &c, &d);
+        return lrope_node(lrope_node(a, c), lrope_node(d, r));
     }
-    putchar(close);
+    return lrope_node(l, r);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if(strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
+// Concatenate, taking the references to both 'l' and 'r'
+lrope* lrope_join(lrope* l, lrope* r) {
+    lrope *a, *b;
+
+    if (l->depth == 0 && r->depth == 0 && l->len + r->len <= LROPE_LEAF) {
+        lrope* n = malloc(sizeof(lrope));
+        n->refs = 1;
+        n->len = l->len + r->len;
+        n->depth = 0;
+        n->left = NULL;
+        n->right = NULL;
+        n->data = malloc(n->len + 1);
+        memcpy(n->data, l->data, l->len);
+        memcpy(n->data + l->len, r->data, r->len + 1);
+        lrope_unref(l);
+        lrope_unref(r);
+        return n;
     }
 
-    if (e->par) {
-        return lenv_get(e->par, k);
+    if (l->depth > r->depth) {
+        lrope_open(l, &a, &b);
+        return lrope_balance(a, lrope_join(b, r));
     }
-    else {
-        return lval_err("Unbound Symbol '%s'", k->sym);
+    if (r->depth > l->depth) {
+        lrope_open(r, &a, &b);
+        return lrope_balance(lrope_join(l, a), b);
     }
+    return lrope_node(l, r);
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i])*sizeof(char) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+// Copy 'n' bytes starting at 'start' into 'out'
+void lrope_read(lrope* r, long start, long n, char* out) {
+    while (n > 0) {
+        if (!r->left) {
+            memcpy(out, r->data + start, n);
+            return;
+        }
+        if (start < r->left->len) {
+            long m = r->left->len - start < n ? r->left->len - start : n;
+            lrope_read(r->left, start, m, out);
+            out += m; n -= m; start = 0;
+        } else {
+            start -= r->left->len;
+        }
+        r = r->right;
     }
-    return n;
 }
 
-lenv_put(lenv* e, lval* k, lval* v);
+// Strings
 
-lenv* lenv_def(lenv * e, lval* k, lval* v) {
-    //iterate till e has no parent
-    while (e->par) {e = e->par;}
-    //put value in e
-    lenv_put(e, k, v);
+// Take a reference to the rope of a string, on behalf of its arena
+// when the string lives in one
+void lval_str_hold(lval* v) {
+    v->rope->refs++;
+    if (v->arena) { larena_hold(larena_live, LHOLD_ROPE, v->rope); }
 }
 
-void lval_println(lval* x) {
-    lval_print(x);
-    putchar('\n');
+lval* lval_str_n(const char* s, long n) {
+    lval* v = lval_new(LVAL_STR);
+    v->slen = n;
+    if (n < LSTR_INLINE) {
+        memcpy(v->sbuf, s, n);
+        v->sbuf[n] = '\0';
+        v->rope = NULL;
+    } else {
+        v->rope = lrope_leaf(s, n);
+        if (v->arena) { larena_hold(larena_live, LHOLD_ROPE, v->rope); }
+    }
+    return v;
 }
 
-lval* lval_eval_sexpr (lenv* e, lval* v);
+lval* lval_str(const char* s) {
+    return lval_str_n(s, strlen(s));
+}
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+// Wrap a rope in a string lval, taking the reference
+lval* lval_str_rope(lrope* r) {
+    if (r->len < LSTR_INLINE) {
+        char buf[LSTR_INLINE];
+        lrope_read(r, 0, r->len, buf);
+        lval* v = lval_str_n(buf, r->len);
+        lrope_unref(r);
+        return v;
     }
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+    lval* v = lval_new(LVAL_STR);
+    v->slen = r->len;
+    v->rope = r;
+    if (v->arena) { larena_hold(larena_live, LHOLD_ROPE, v->rope); }
     return v;
 }
-lval* lval_pop(lval* v, int i) {
-    //find the item at "i"
-    lval* x = v->cell[i];
 
-    //shift memory after the item at "i" over the top
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+// Get a new reference to the contents of a string as a rope
+lrope* lval_str_as_rope(lval* v) {
+    if (v->rope) { v->rope->refs++; return v->rope; }
+    return lrope_leaf(v->sbuf, v->slen);
+}
 
-    //decrease the count of items in the list
-    v->count--;
+// Return the contents of a string as a newly allocated C string
+char* lval_str_flat(lval* v) {
+    char* s = malloc(v->slen + 1);
+    if (v->rope) { lrope_read(v->rope, 0, v->slen, s); }
+    else { memcpy(s, v->sbuf, v->slen); }
+    s[v->slen] = '\0';
+    return s;
+}
 
-    // reallocate the memory used
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+// Structural hashing and equality, used by maps and sets
+
+unsigned long long lhash_mix(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-lval* lval_take(lval* v, int i) {
-    lval * x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+unsigned long long lhash_bytes(unsigned long long h, const void* p, size_t n) {
+    const unsigned char* b = p;
+    for (size_t i = 0; i < n; i++) { h = (h ^ b[i]) * 0x100000001b3ULL; }
+    return h;
 }
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+// Functions and errors have no useful identity, so they cannot be keys
+int lval_hashable(lval* v) {
+    switch (v->type) {
+        case LVAL_FUN:
+        case LVAL_ERR: return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_hashable(v->cell[i])) { return 0; }
+            }
+            return 1;
+        case LVAL_MAP:
+        case LVAL_SET:
+            for (int i = 0; i < v->map->used; i++) {
+                if (!v->map->keys[i]) { continue; }
+                if (v->map->vals && !lval_hashable(v->map->vals[i])) { return 0; }
+            }
+            return 1;
+        default: return 1;
+    }
 }
 
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+unsigned long long lval_hash(lval* v) {
+    unsigned long long h = lhash_mix(0x9e3779b97f4a7c15ULL + v->type);
+    switch (v->type) {
+        case LVAL_NUM: return lhash_mix(h ^ (unsigned long long)v->num);
+        case LVAL_DBL: {
+            // make sure 0.0 and -0.0 land together as they compare equal
+            double d = v->dbl == 0 ? 0 : v->dbl;
+            return lhash_bytes(h, &d, sizeof(double));
+        }
+        case LVAL_SYM: return lhash_bytes(h, v->sym, strlen(v->sym));
+        case LVAL_STR: {
+            char* s = lval_str_flat(v);
+            h = lhash_bytes(h, s, v->slen);
+            free(s);
+            return h;
+        }
+        case LVAL_VEC:
+            h = lhash_mix(h ^ v->vkind);
+            return lhash_bytes(h, v->vdata, v->count *
+                (v->vkind == LVEC_INT ? sizeof(long long) : sizeof(double)));
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                h = lhash_mix(h ^ lval_hash(v->cell[i])) + i;
+            }
+            return h;
+        case LVAL_MAP:
+        case LVAL_SET: {
+            // order independent so equal maps hash equally
+            unsigned long long sum = 0;
+            for (int i = 0; i < v->map->used; i++) {
+                if (!v->map->keys[i]) { continue; }
+                unsigned long long eh = v->map->hashes[i];
+                if (v->map->vals) { eh = lhash_mix(eh ^ lval_hash(v->map->vals[i])); }
+                sum += eh;
+            }
+            return lhash_mix(h ^ sum);
+        }
+        default: return h;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
 }
 
+int lmap_find(lmap* m, lval* k, unsigned long long h);
+
+int lval_eq(lval* x, lval* y) {
+    // Interned values are unique, so their identity decides equality.
+    // Floats are interned by bit pattern, which keeps -0.0 apart from
+    // 0.0, so floats and expressions that may hold them compare below.
+    if (x == y) { return 1; }
+    if (x->interned && y->interned && x->type != LVAL_DBL
+        && x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return 0; }
+    if (x->type != y->type) { return 0; }
+
+    switch (x->type) {
+        case LVAL_NUM: return x->num == y->num;
+        case LVAL_DBL: return x->dbl == y->dbl;
+        case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+        case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+        case LVAL_STR: {
+            if (x->slen != y->slen) { return 0; }
+            if (!x->rope) { return memcmp(x->sbuf, y->sbuf, x->slen) == 0; }
+            char* xs = lval_str_flat(x);
+            char* ys = lval_str_flat(y);
+            int eq = memcmp(xs, ys, x->slen) == 0;
+            free(xs); free(ys);
+            return eq;
+        }
+        case LVAL_FUN:
+            if (x->builtin || y->builtin) { return x->builtin == y->builtin; }
+            return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+        case LVAL_VEC:
+            return x->vkind == y->vkind && x->count == y->count
+                && memcmp(x->vdata, y->vdata, x->count *
+                    (x->vkind == LVEC_INT ? sizeof(long long) : sizeof(double))) == 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (x->count != y->count) { return 0; }
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+            }
+            return 1;
+        case LVAL_MAP:
+        case LVAL_SET:
+            if (x->map->count != y->map->count) { return 0; }
+            for (int i = 0; i < x->map->used; i++) {
+                if (!x->map->keys[i]) { continue; }
+                int j = lmap_find(y->map, x->map->keys[i], x->map->hashes[i]);
+                if (j < 0) { return 0; }
+                if (x->map->vals && !lval_eq(x->map->vals[i], y->map->vals[j])) { return 0; }
+            }
+            return 1;
+    }
+    return 0;
+}
 
-void lenv_put(lenv* e, lval* k, lval* v) {
+// Hash Table
+
+enum { LMAP_SLOTS_MIN = 8 };
+
+lmap* lmap_new(int set) {
+    lmap* m = lmem_alloc(lspace_arena, sizeof(lmap));
+    m->arena = lspace_arena;
+    m->count = 0;
+    m->used = 0;
+    m->slots = LMAP_SLOTS_MIN;
+    m->index = lmem_alloc(m->arena, sizeof(int) * m->slots);
+    memset(m->index, -1, sizeof(int) * m->slots);
+    m->hashes = lmem_alloc(m->arena, sizeof(unsigned long long) * m->slots);
+    m->keys = lmem_alloc(m->arena, sizeof(lval*) * m->slots);
+    m->vals = set ? NULL : lmem_alloc(m->arena, sizeof(lval*) * m->slots);
+    return m;
+}
+
+void lmap_del(lmap* m) {
+    if (m->arena) { return; }
+    lsweep_push(LSWEEP_MAP, m);
+}
+
+// Returns the entry position holding 'k' or -1
+int lmap_find(lmap* m, lval* k, unsigned long long h) {
+    int mask = m->slots - 1;
+    for (int s = h & mask; m->index[s] != -1; s = (s + 1) & mask) {
+        int j = m->index[s];
+        if (m->hashes[j] == h && m->keys[j] && lval_eq(m->keys[j], k)) { return j; }
+    }
+    return -1;
+}
+
+// Compact the entries and rebuild the index with room for 'need' entries
+void lmap_rebuild(lmap* m, int need) {
+    int slots = LMAP_SLOTS_MIN;
+    while (slots * 2 < need * 3) { slots *= 2; }
+
+    int n = 0;
+    for (int i = 0; i < m->used; i++) {
+        if (!m->keys[i]) { continue; }
+        m->hashes[n] = m->hashes[i];
+        m->keys[n] = m->keys[i];
+        if (m->vals) { m->vals[n] = m->vals[i]; }
+        n++;
+    }
+    m->used = n;
+
+    m->slots = slots;
+    m->index = lmem_realloc(m->arena, m->index, sizeof(int) * slots);
+    memset(m->index, -1, sizeof(int) * slots);
+    m->hashes = lmem_realloc(m->arena, m->hashes, sizeof(unsigned long long) * slots);
+    m->keys = lmem_realloc(m->arena, m->keys, sizeof(lval*) * slots);
+    if (m->vals) { m->vals = lmem_realloc(m->arena, m->vals, sizeof(lval*) * slots); }
+
+    for (int i = 0; i < n; i++) {
+        int s = m->hashes[i] & (slots - 1);
+        while (m->index[s] != -1) { s = (s + 1) & (slots - 1); }
+        m->index[s] = i;
+    }
+}
+
+// Insert or replace, taking ownership of 'k' and 'v'
+void lmap_put(lmap* m, lval* k, lval* v) {
+    unsigned long long h = lval_hash(k);
+    int j = lmap_find(m, k, h);
+    if (j >= 0) {
+        lval_del(k);
+        if (m->vals) { lval_del(m->vals[j]); m->vals[j] = v; }
+        return;
+    }
+
+    // keep the index at most two thirds full, counting removed entries
+    if ((m->used + 1) * 3 > m->slots * 2) { lmap_rebuild(m, (m->count + 1) * 2); }
+
+    j = m->used++;
+    m->hashes[j] = h;
+    m->keys[j] = k;
+    if (m->vals) { m->vals[j] = v; }
+    m->count++;
+
+    int s = h & (m->slots - 1);
+    while (m->index[s] != -1) { s = (s + 1) & (m->slots - 1); }
+    m->index[s] = j;
+}
+
+void lmap_remove(lmap* m, lval* k) {
+    int j = lmap_find(m, k, lval_hash(k));
+    if (j < 0) { return; }
+    lval_del(m->keys[j]);
+    if (m->vals) { lval_del(m->vals[j]); }
+    m->keys[j] = NULL;
+    m->count--;
+}
+
+lmap* lmap_copy(lmap* m) {
+    lmap* n = lmap_new(m->vals == NULL);
+    lmap_rebuild(n, m->count * 2);
+    for (int i = 0; i < m->used; i++) {
+        if (!m->keys[i]) { continue; }
+        lmap_put(n, lval_copy(m->keys[i]),
+            m->vals ? lval_copy(m->vals[i]) : NULL);
+    }
+    return n;
+}
+
+// Hash-consing
+//
+// When switched on, values stored into an environment are canonicalised
+// through this table. Structurally equal numbers, symbols, strings and
+// expressions built from them collapse into one shared, reference
+// counted copy, so looking them up again is a reference count bump and
+// equality between two interned values is pointer equality. The table
+// does not hold references itself: a value leaves it when its last
+// reference is deleted.
+
+typedef struct {
+    int enabled;
+    int count;
+    int used;
+    int slots;
+    lval** vals;
+    unsigned long long* hashes;
+    long requests;
+    long shared;
+} lhashcons;
+
+lhashcons lhc = { 0, 0, 0, 0, NULL, NULL, 0, 0 };
+
+// Marks a slot whose value has been removed
+lval lhc_removed;
+
+// Children of interned values are interned too, so only the identity
+// of the children needs to be hashed and compared
+unsigned long long lhc_hash(lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return lval_hash(v); }
+    unsigned long long h = lhash_mix(0x9e3779b97f4a7c15ULL + v->type);
+    for (int i = 0; i < v->count; i++) {
+        h = lhash_mix(h ^ (unsigned long long)(size_t)v->cell[i]) + i;
+    }
+    return h;
+}
+
+int lhc_eq(lval* x, lval* y) {
+    if (x->type != y->type) { return 0; }
+    if (x->type == LVAL_DBL) { return memcmp(&x->dbl, &y->dbl, sizeof(double)) == 0; }
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return lval_eq(x, y); }
+    if (x->count != y->count) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i] != y->cell[i]) { return 0; }
+    }
+    return 1;
+}
+
+void lhc_insert(lval* v, unsigned long long h) {
+    int mask = lhc.slots - 1;
+    int s = h & mask;
+    while (lhc.vals[s] && lhc.vals[s] != &lhc_removed) { s = (s + 1) & mask; }
+    if (!lhc.vals[s]) { lhc.used++; }
+    lhc.vals[s] = v;
+    lhc.hashes[s] = h;
+    lhc.count++;
+}
+
+void lhc_resize(void) {
+    lval** vals = lhc.vals;
+    unsigned long long* hashes = lhc.hashes;
+    int slots = lhc.slots;
+
+    lhc.slots = 64;
+    while (lhc.slots < lhc.count * 4) { lhc.slots *= 2; }
+    lhc.vals = calloc(lhc.slots, sizeof(lval*));
+    lhc.hashes = malloc(sizeof(unsigned long long) * lhc.slots);
+    lhc.count = 0;
+    lhc.used = 0;
+
+    for (int i = 0; i < slots; i++) {
+        if (vals[i] && vals[i] != &lhc_removed) { lhc_insert(vals[i], hashes[i]); }
+    }
+    free(vals);
+    free(hashes);
+}
+
+// Called by lval_del before the last reference to 'v' goes away
+void lhc_remove(lval* v) {
+    int mask = lhc.slots - 1;
+    for (int s = lhc_hash(v) & mask; lhc.vals[s]; s = (s + 1) & mask) {
+        if (lhc.vals[s] == v) {
+            lhc.vals[s] = &lhc_removed;
+            lhc.count--;
+            return;
+        }
+    }
+}
+
+int lval_internable(lval* v) {
+    switch (v->type) {
+        case LVAL_NUM:
+        case LVAL_DBL:
+        case LVAL_SYM:
+        case LVAL_STR: return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_internable(v->cell[i])) { return 0; }
+            }
+            return 1;
+        default: return 0;
+    }
+}
+
+lval* lval_intern_tree(lval* v) {
+    if (v->interned) { return v; }
+
+    for (int i = 0; i < v->count && (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR); i++) {
+        v->cell[i] = lval_intern_tree(v->cell[i]);
+    }
+
+    if ((lhc.used + 1) * 3 > lhc.slots * 2) { lhc_resize(); }
+
+    unsigned long long h = lhc_hash(v);
+    int mask = lhc.slots - 1;
+    lhc.requests++;
+    for (int s = h & mask; lhc.vals[s]; s = (s + 1) & mask) {
+        lval* x = lhc.vals[s];
+        if (x != &lhc_removed && lhc.hashes[s] == h && lhc_eq(x, v)) {
+            lhc.shared++;
+            x->refs++;
+            lval_del(v);
+            return x;
+        }
+    }
+
+    v->interned = 1;
+    v->refs = 1;
+    lhc_insert(v, h);
+    return v;
+}
+
+// Canonicalise 'v', taking ownership of it. Values that cannot be
+// shared are returned unchanged, except that the formals and body of
+// a lambda are interned in place.
+lval* lval_intern(lval* v) {
+    if (!lhc.enabled || v->interned) { return v; }
+    if (v->type == LVAL_FUN && !v->builtin) {
+        v->formals = lval_intern(v->formals);
+        v->body = lval_intern(v->body);
+        return v;
+    }
+    if (!lval_internable(v)) { return v; }
+    return lval_intern_tree(v);
+}
+
+// Get a private, mutable version of 'v', taking ownership of it.
+// An interned value is replaced by a shallow copy whose children
+// stay shared, so callers that go on to mutate a child own it too.
+lval* lval_own(lval* v) {
+    if (!v->interned) { return v; }
+
+    lval* x = lval_new(v->type);
+    switch (v->type) {
+        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_DBL: x->dbl = v->dbl; break;
+        case LVAL_SYM:
+            x->sym = lmem_alloc(x->arena, strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            x->ic = v->ic;
+            break;
+        case LVAL_STR:
+            x->slen = v->slen;
+            memcpy(x->sbuf, v->sbuf, LSTR_INLINE);
+            x->rope = v->rope;
+            if (x->rope) { lval_str_hold(x); }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count = v->count;
+            x->site = lspec_site_ref(v->site, x->arena);
+            x->cell = lmem_alloc(x->arena, sizeof(lval*) * v->count);
+            for (int i = 0; i < v->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            break;
+    }
+
+    lval_del(v);
+    return x;
+}
+
+// Where values are printed, stdout unless a batch run is capturing
+// what an expression prints for the printer thread
+FILE* lout;
+
+void lval_print(lval* v);
+void lval_expr_print(lval* v, char open, char close);
+void lval_map_print(lval* v);
+void lval_str_print(lval* v);
+
+// Print a double so that it reads back as a float
+void lval_print_dbl(double d) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", d);
+    if (strtod(buf, NULL) != d) { snprintf(buf, sizeof(buf), "%.17g", d); }
+    fputs(buf, lout);
+    if (!strpbrk(buf, ".eni")) { fputs(".0", lout); }
+}
+
+void lval_vec_print(lval* v) {
+    fputc('[', lout);
+    for (int i = 0; i < v->count; i++) {
+        if (v->vkind == LVEC_INT) {
+            fprintf(lout, "%lli", ((long long*)v->vdata)[i]);
+        } else {
+            lval_print_dbl(((double*)v->vdata)[i]);
+        }
+        if (i != (v->count-1)) { fputc(' ', lout); }
+    }
+    fputc(']', lout);
+}
+
+void lval_print (lval* v) {
+    switch(v->type) {
+        case LVAL_NUM: fprintf(lout, "%lli", v->num); break;
+        case LVAL_DBL: lval_print_dbl(v->dbl); break;
+        case LVAL_VEC: lval_vec_print(v); break;
+        case LVAL_MAP:
+        case LVAL_SET: lval_map_print(v); break;
+        case LVAL_STR: lval_str_print(v); break;
+        case LVAL_ERR: fprintf(lout, "Error: %s", v->err); break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                fprintf(lout, "<builtin>");
+            } else {
+                fprintf(lout, "(\\ "); lval_print(v->formals);
+                fputc(' ', lout); lval_print(v->body); fputc(')', lout);
+            }
+        break;
+        case LVAL_SYM: fprintf(lout, "%s", v->sym); break;
+        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
+        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+    }
+}
+
+void lval_str_print(lval* v) {
+    // pass the contents through the mpc escape function
+    char* escaped = mpcf_escape(lval_str_flat(v));
+    fprintf(lout, "\"%s\"", escaped);
+    free(escaped);
+}
+
+// Print maps and sets as the expression that builds them
+void lval_map_print(lval* v) {
+    fprintf(lout, v->type == LVAL_MAP ? "(map-new {" : "(set-new {");
+    int first = 1;
+    for (int i = 0; i < v->map->used; i++) {
+        if (!v->map->keys[i]) { continue; }
+        if (!first) { fputc(' ', lout); }
+        first = 0;
+        lval_print(v->map->keys[i]);
+        if (v->map->vals) { fputc(' ', lout); lval_print(v->map->vals[i]); }
+    }
+    fprintf(lout, "})");
+}
+
+void lval_expr_print(lval* v, char open, char close) {
+    fputc(open, lout);
+    for (int i = 0; i < v->count; i++) {
+
+        //Print Value contained within
+        lval_print(v->cell[i]);
+
+        //don't print trailing space for the last element
+        if (i != (v->count-1)) {
+            fputc(' ', lout);
+        }
+    }
+    fputc(close, lout);
+}
+
+// Global inline caches
+//
+// Every symbol read from source carries a cache cell remembering the
+// slot of its name in the global environment. Function bodies are
+// copied for every call, so the cell is shared by all symbols of the
+// same name rather than kept in the symbol itself; what it holds only
+// depends on the name anyway.
+//
+// A cell is valid while its version matches that of the global
+// environment, which moves on whenever something is bound there or a
+// name becomes shadowed. Only names that are never bound locally are
+// cached, so on a hit the lookup can skip the calling environments.
+
+typedef struct {
+    long version;
+    int slot;
+} lic_cell_t;
+
+typedef struct {
+    lenv* root;
+    long version;
+
+    // cells by name
+    lmap* names;
+    lic_cell_t* cells;
+} lic_t;
+
+lic_t lic = { NULL, 1, NULL, NULL };
+
+int lic_cell(char* s) {
+    int prev = lspace_set(0);
+    if (!lic.names) { lic.names = lmap_new(1); }
+
+    lval* k = lval_sym(s);
+    int j = lmap_find(lic.names, k, lval_hash(k));
+    if (j < 0) {
+        j = lic.names->used;
+        lmap_put(lic.names, k, NULL);
+        lic.cells = realloc(lic.cells, sizeof(lic_cell_t) * lic.names->used);
+        lic.cells[j].version = 0;
+    } else {
+        lval_del(k);
+    }
+
+    lspace_set(prev);
+    return j + 1;
+}
+
+int linline_is_shadowed(char* s);
+void ljit_rebound(char* name);
+
+lval* lenv_get(lenv* e, lval* k) {
+    if (k->ic && lic.cells[k->ic - 1].version == lic.version) {
+        return lval_copy(lic.root->vals[lic.cells[k->ic - 1].slot]);
+    }
+
+    for (int i = 0; i < e->count; i++) {
+        if(strcmp(e->syms[i], k->sym) == 0) {
+            if (k->ic && e == lic.root && !linline_is_shadowed(k->sym)) {
+                lic.cells[k->ic - 1].version = lic.version;
+                lic.cells[k->ic - 1].slot = i;
+            }
+            return lval_copy(e->vals[i]);
+        }
+    }
+
+    if (e->par) {
+        return lenv_get(e->par, k);
+    }
+    else {
+        return lval_err("Unbound Symbol '%s'", k->sym);
+    }
+}
+
+lenv* lenv_copy(lenv* e) {
+    lenv* n = lmem_alloc(lspace_arena, sizeof(lenv));
+    n->arena = lspace_arena;
+    n->frame = 0;
+    n->par = e->par;
+    n->count = e->count;
+    n->syms = lmem_alloc(n->arena, sizeof(char*) * n->count);
+    n->vals = lmem_alloc(n->arena, sizeof(lval*) * n->count);
+    for (int i = 0; i < e->count; i++) {
+        n->syms[i] = lmem_alloc(n->arena, strlen(e->syms[i])*sizeof(char) + 1);
+        strcpy(n->syms[i], e->syms[i]);
+        n->vals[i] = lval_copy(e->vals[i]);
+    }
+    return n;
+}
+
+void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_put_move(lenv* e, lval* k, lval* v);
+
+void lenv_def(lenv * e, lval* k, lval* v) {
+    //iterate till e has no parent
+    while (e->par) {e = e->par;}
+    //put value in e
+    lenv_put(e, k, v);
+}
+
+// As lenv_def, but taking ownership of 'v'
+void lenv_def_move(lenv* e, lval* k, lval* v) {
+    while (e->par) {e = e->par;}
+    lenv_put_move(e, k, v);
+}
+
+void lval_println(lval* x) {
+    lval_print(x);
+    fputc('\n', lout);
+}
+
+lval* lval_eval_sexpr (lenv* e, lval* v);
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+    return v;
+}
+lval* lval_pop(lval* v, int i) {
+    //find the item at "i"
+    lval* x = v->cell[i];
+
+    //shift memory after the item at "i" over the top
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+
+    //decrease the count of items in the list
+    v->count--;
+
+    // reallocate the memory used
+    v->cell = lmem_realloc(v->arena, v->cell, sizeof(lval*) * v->count);
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    lval * x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+lenv* lenv_new(void) {
+    lenv* e = lmem_alloc(lspace_arena, sizeof(lenv));
+    e->arena = lspace_arena;
+    e->frame = 0;
+    e->par = NULL;
+    e->count = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    return e;
+}
+
+// Call frames
+//
+// Non-escaping lambdas are called in frames taken from a pool, one per
+// call depth, rather than in a copy of their own environment. A frame
+// holds arena values like an arena environment does, but its arrays are
+// kept from call to call and it borrows the symbol strings of the
+// function's formals, so a call and its return never allocate.
+
+typedef struct {
+    int depth;
+    int slots;
+    lenv** frames;
+} lframes_t;
+
+lframes_t lframes = { 0, 0, NULL };
+
+lenv* lframe_push(lenv* par) {
+    if (lframes.depth == lframes.slots) {
+        lframes.slots = lframes.slots ? lframes.slots * 2 : 16;
+        lframes.frames = realloc(lframes.frames, sizeof(lenv*) * lframes.slots);
+        for (int i = lframes.depth; i < lframes.slots; i++) {
+            lenv* f = malloc(sizeof(lenv));
+            f->arena = 1;
+            f->frame = 1;
+            f->slots = 4;
+            f->syms = malloc(sizeof(char*) * f->slots);
+            f->vals = malloc(sizeof(lval*) * f->slots);
+            lframes.frames[i] = f;
+        }
+    }
+    lenv* f = lframes.frames[lframes.depth++];
+    f->par = par;
+    f->count = 0;
+    return f;
+}
+
+// The bindings are arena values, so dropping them is left to the arena
+void lframe_pop(void) {
+    lframes.depth--;
+}
+
+void lenv_del(lenv* e) {
+    if (e->arena) { return; }
+    lsweep_push(LSWEEP_ENV, e);
+}
+
+
+int lenv_is_root(lenv* e);
+void linline_rebound(char* name, lval* v);
+void ljit_attach(char* name, lval* f);
+void lspec_attach(lval* f);
+
+// Store 'v', which already lives in the space of 'e', under 'k'. The
+// current space must be that of 'e'.
+void lenv_bind(lenv* e, lval* k, lval* v) {
+    if (!e->arena) { v = lval_intern(v); }
 
     // Iterate over all items in environment
     // This is to see if variable already exists
     for (int i = 0; i < e->count; i++) {
 
-        // if variable is found delete item at that position
-        // and replace with variable supplied by user
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+        // if variable is found delete item at that position
+        // and replace with variable supplied by user
+        if (strcmp(e->syms[i], k->sym) == 0) {
+            lval_del(e->vals[i]);
+            e->vals[i] = v;
+            if (lenv_is_root(e)) {
+                lic.version++;
+                linline_rebound(k->sym, v);
+                lspec_attach(v);
+                ljit_attach(k->sym, v);
+            }
+            return;
+        }
+    }
+
+    // frames reuse their arrays and borrow the symbol, which outlives
+    // the call
+    if (e->frame) {
+        if (e->count == e->slots) {
+            e->slots *= 2;
+            e->syms = realloc(e->syms, sizeof(char*) * e->slots);
+            e->vals = realloc(e->vals, sizeof(lval*) * e->slots);
+        }
+        e->syms[e->count] = k->sym;
+        e->vals[e->count] = v;
+        e->count++;
+        return;
+    }
+
+    // if no existing entry found allocate space for new entry
+    e->count++;
+    e->vals = lmem_realloc(e->arena, e->vals, sizeof(lval*) * e->count);
+    e->syms = lmem_realloc(e->arena, e->syms, sizeof(char*) * e->count);
+
+    // store the value and copy the symbol string into new location
+    e->vals[e->count-1] = v;
+    e->syms[e->count-1] = lmem_alloc(e->arena, (strlen(k->sym)+1) * sizeof(char));
+    strcpy(e->syms[e->count-1], k->sym);
+    if (lenv_is_root(e)) {
+        lic.version++;
+        linline_rebound(k->sym, v);
+        lspec_attach(v);
+        ljit_attach(k->sym, v);
+    }
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+
+    // Write barrier: values are copied into the space the environment
+    // lives in, so a young value stored into an old environment is
+    // promoted to the heap
+    int prev = lspace_set(e->arena);
+    if (!e->arena && v->arena) { lgc.promoted++; }
+    lenv_bind(e, k, lval_copy(v));
+    lspace_set(prev);
+}
+
+// As lenv_put, but taking ownership of 'v' so that it is stored without
+// a copy whenever it already lives in the space of 'e'
+void lenv_put_move(lenv* e, lval* k, lval* v) {
+    int prev = lspace_set(e->arena);
+
+    // Otherwise it still goes through the write barrier. References to
+    // interned values belong to the arena while evaluating, so the
+    // environment takes its own.
+    if (v->arena != e->arena || (v->interned && prev)) {
+        if (!e->arena && v->arena) { lgc.promoted++; }
+        lval* x = lval_copy(v);
+        lspace_set(prev);
+        lval_del(v);
+        lspace_set(e->arena);
+        v = x;
+    }
+
+    lenv_bind(e, k, v);
+    lspace_set(prev);
+}
+// Inlining
+//
+// When a lambda is bound in the global environment, calls in its body
+// to small global helpers are replaced by the helper's body with the
+// argument expressions put in place of its formals, so that the helper
+// costs nothing at run time. Symbols are looked up dynamically through
+// the chain of calling environments, so a global can be shadowed by a
+// local binding of the same name anywhere. Every name that is ever
+// bound locally, as a formal or by '=', is therefore kept out of
+// inlining for good.
+//
+// Calls of pure builtins on constants, both those written out and those
+// left behind by inlining, are folded to their result.
+//
+// An optimized function remembers its original body and the names its
+// inlined and folded code depends on. When one of them is rebound or
+// becomes shadowed, the function gets its original body back and is
+// optimized again against the new definitions.
+
+enum { LINLINE_BODY = 16, LINLINE_BUDGET = 256 };
+
+typedef struct {
+    int enabled;
+    lenv* root;
+
+    // optimized functions, their original bodies and dependencies
+    int count;
+    char** names;
+    lval** sources;
+    lval** deps;
+
+    lmap* shadowed;
+    long sites;
+    long folds;
+
+    // print every inlining and folding decision
+    int dump;
+} linline_t;
+
+linline_t linl = { 1, NULL, 0, NULL, NULL, NULL, NULL, 0, 0, 0 };
+
+// Whether 'e' is the global environment
+int lenv_is_root(lenv* e) {
+    return e == linl.root;
+}
+
+// Value bound to 's' in 'e' itself, without a copy
+lval* lenv_find(lenv* e, char* s) {
+    for (int i = 0; i < e->count; i++) {
+        if (strcmp(e->syms[i], s) == 0) { return e->vals[i]; }
+    }
+    return NULL;
+}
+
+int lval_mentions(lval* x, char* s) {
+    if (x->type == LVAL_SYM) { return strcmp(x->sym, s) == 0; }
+    if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+        for (int i = 0; i < x->count; i++) {
+            if (lval_mentions(x->cell[i], s)) { return 1; }
+        }
+    }
+    return 0;
+}
+
+int linline_is_shadowed(char* s) {
+    if (!linl.shadowed) { return 0; }
+    lval k;
+    k.type = LVAL_SYM;
+    k.sym = s;
+    k.interned = 0;
+    return lmap_find(linl.shadowed, &k, lval_hash(&k)) >= 0;
+}
+
+// Number of nodes in a helper body, or more than any limit when it
+// holds a Q-Expression, whose evaluation cannot be followed
+int linline_size(lval* x) {
+    if (x->type == LVAL_QEXPR) { return LINLINE_BUDGET + 1; }
+    if (x->type != LVAL_SEXPR) { return 1; }
+    int n = 1;
+    for (int i = 0; i < x->count; i++) { n += linline_size(x->cell[i]); }
+    return n;
+}
+
+// Index of formal 's' or -1
+int linline_formal(lval* formals, char* s) {
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, s) == 0) { return i; }
+    }
+    return -1;
+}
+
+// Record in evaluation order which formals 'x' uses and how often
+void linline_uses(lval* x, lval* formals, int* uses, int* order, int* n) {
+    if (x->type == LVAL_SYM) {
+        int i = linline_formal(formals, x->sym);
+        if (i >= 0 && uses[i]++ == 0) { order[(*n)++] = i; }
+    }
+    if (x->type == LVAL_SEXPR) {
+        for (int i = 0; i < x->count; i++) {
+            linline_uses(x->cell[i], formals, uses, order, n);
+        }
+    }
+}
+
+// Copy of 'x' with every formal replaced by its argument expression,
+// the arguments being cells 1 onwards of the call 'c'
+lval* linline_subst(lval* x, lval* formals, lval* c) {
+    if (x->type == LVAL_SYM) {
+        int i = linline_formal(formals, x->sym);
+        if (i >= 0) { return lval_copy(c->cell[i + 1]); }
+    }
+    if (x->type != LVAL_SEXPR) { return lval_copy(x); }
+    lval* y = lval_sexpr();
+    for (int i = 0; i < x->count; i++) {
+        lval_add(y, linline_subst(x->cell[i], formals, c));
+    }
+    return y;
+}
+
+int linline_record(char* name) {
+    for (int i = 0; i < linl.count; i++) {
+        if (strcmp(linl.names[i], name) == 0) { return i; }
+    }
+    return -1;
+}
+
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_list(lenv* e, lval* a);
+lval* builtin_head(lenv* e, lval* a);
+lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_join(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_load(lenv* e, lval* a);
+lval* builtin_def(lenv* e, lval* a);
+lval* builtin_put(lenv* e, lval* a);
+lval* builtin_defmacro(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_vec_map(lenv* e, lval* a);
+
+// Builtins whose result depends on nothing but their arguments
+int lfold_pure(lbuiltin f) {
+    return f == builtin_add || f == builtin_sub || f == builtin_mul
+        || f == builtin_div || f == builtin_list || f == builtin_head
+        || f == builtin_tail || f == builtin_join;
+}
+
+// Values that evaluate to themselves
+int lfold_const(lval* x) {
+    return x->type == LVAL_NUM || x->type == LVAL_DBL
+        || x->type == LVAL_STR || x->type == LVAL_QEXPR;
+}
+
+// The dump is a diagnostic, so it goes to stderr with the errors and
+// leaves stdout to what the program prints
+void linline_dump(char* what, char* self, lval* from, lval* to) {
+    if (!linl.dump) { return; }
+    FILE* out = lout;
+    lout = stderr;
+    fprintf(lout, ";; %s in '%s': ", what, self);
+    lval_print(from);
+    fputs(" => ", lout);
+    lval_print(to);
+    fputc('\n', lout);
+    lout = out;
+}
+
+// Fold S-Expression 'x' if it applies a pure builtin to constants,
+// taking ownership of 'x'. Calls that fail are left for run time.
+lval* lfold_apply(lval* x, char* self, lval* deps) {
+    if (x->count < 2 || x->cell[0]->type != LVAL_SYM) { return x; }
+    char* s = x->cell[0]->sym;
+    if (linline_is_shadowed(s)) { return x; }
+    lval* g = lenv_find(linl.root, s);
+    if (!g || g->type != LVAL_FUN || !lfold_pure(g->builtin)) { return x; }
+    for (int i = 1; i < x->count; i++) {
+        if (!lfold_const(x->cell[i])) { return x; }
+    }
+
+    lval* a = lval_sexpr();
+    for (int i = 1; i < x->count; i++) { lval_add(a, lval_copy(x->cell[i])); }
+    lval* r = g->builtin(linl.root, a);
+    if (r->type == LVAL_ERR) {
+        lval_del(r);
+        return x;
+    }
+
+    linline_dump("fold", self, x, r);
+    lval_add(deps, lval_sym(s));
+    linl.folds++;
+    lval_del(x);
+    return r;
+}
+
+// Fold every constant call within 'x', innermost first
+lval* lfold_expr(lval* x, char* self, lval* deps) {
+    if (x->type != LVAL_SEXPR) { return x; }
+    x = lval_own(x);
+    for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lfold_expr(x->cell[i], self, deps);
+    }
+    return lfold_apply(x, self, deps);
+}
+
+// Builtins that evaluate, call or bind in the environment they are
+// called from, which is a different one once the call is inlined
+int linline_scoped(lbuiltin f) {
+    return f == builtin_eval || f == builtin_load || f == builtin_def
+        || f == builtin_put || f == builtin_defmacro || f == builtin_lambda
+        || f == builtin_vec_map;
+}
+
+// Whether helper body 'x' only calls global builtins and names nothing
+// but those and its own formals, adding the builtins to 'used'. Any
+// other function it ends up calling would find the helper's formals
+// through the chain of calling environments, and those bindings are
+// gone once the helper is inlined.
+int linline_closed(lval* x, lval* formals, lval* used) {
+    if (x->type == LVAL_SYM) {
+        if (linline_formal(formals, x->sym) >= 0) { return 1; }
+        if (linline_is_shadowed(x->sym)) { return 0; }
+        lval* b = lenv_find(linl.root, x->sym);
+        if (!b || b->type != LVAL_FUN || !b->builtin
+            || linline_scoped(b->builtin)) { return 0; }
+        lval_add(used, lval_sym(x->sym));
+        return 1;
+    }
+    // the body itself is a Q-Expression evaluated as an S-Expression
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return 1; }
+    if (x->count > 1 && (x->cell[0]->type != LVAL_SYM
+        || linline_formal(formals, x->cell[0]->sym) >= 0)) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        if (!linline_closed(x->cell[i], formals, used)) { return 0; }
+    }
+    return 1;
+}
+
+lval* lval_join(lval* x, lval* y);
+
+// Inline calls within S-Expression 'x' of the body of 'self', taking
+// ownership of 'x' and adding the helpers used to 'deps'
+lval* linline_expr(lval* x, lval* formals, char* self, lval* deps, int* budget) {
+    x = lval_own(x);
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i]->type == LVAL_SEXPR) {
+            x->cell[i] = linline_expr(x->cell[i], formals, self, deps, budget);
+        }
+    }
+
+    x = lfold_apply(x, self, deps);
+    if (x->type != LVAL_SEXPR) { return x; }
+
+    // the call must be to a global, small, non-recursive lambda that
+    // is given all of its arguments
+    if (x->count < 2 || x->cell[0]->type != LVAL_SYM) { return x; }
+    char* s = x->cell[0]->sym;
+    if (strcmp(s, self) == 0 || linline_formal(formals, s) >= 0
+        || linline_is_shadowed(s)) { return x; }
+
+    lval* g = lenv_find(linl.root, s);
+    if (!g || g->type != LVAL_FUN || g->builtin || g->env->count
+        || !g->noescape || g->formals->count != x->count - 1) { return x; }
+    // the body itself is a Q-Expression evaluated as an S-Expression
+    int size = 1;
+    for (int i = 0; i < g->body->count; i++) {
+        size += linline_size(g->body->cell[i]);
+    }
+    if (size > LINLINE_BODY || size > *budget || lval_mentions(g->body, s)) {
+        return x;
+    }
+    lval* used = lval_qexpr();
+    if (!linline_closed(g->body, g->formals, used)) {
+        lval_del(used);
+        return x;
+    }
+
+    // arguments must still be evaluated, and in the same order, so each
+    // formal is used once and in order, unless its argument is plain
+    int n = 0;
+    int uses[g->formals->count];
+    int order[g->formals->count];
+    memset(uses, 0, sizeof(uses));
+    for (int i = 0; i < g->body->count; i++) {
+        linline_uses(g->body->cell[i], g->formals, uses, order, &n);
+    }
+    if (n != g->formals->count) { lval_del(used); return x; }
+    for (int i = 0; i < n; i++) {
+        if (order[i] != i || (uses[i] > 1 && x->cell[i + 1]->type == LVAL_SEXPR)) {
+            lval_del(used);
+            return x;
+        }
+    }
+
+    lval* y = lval_sexpr();
+    for (int i = 0; i < g->body->count; i++) {
+        lval_add(y, linline_subst(g->body->cell[i], g->formals, x));
+    }
+    linline_dump("inline", self, x, y);
+    lval_del(x);
+
+    // depend on the helper, the builtins it calls and on whatever was
+    // inlined into it
+    lval_add(deps, lval_sym(s));
+    deps = lval_join(deps, used);
+    int r = linline_record(s);
+    if (r >= 0) { deps = lval_join(deps, lval_copy(linl.deps[r])); }
+    *budget -= size;
+    linl.sites++;
+
+    // constant arguments may leave constant calls behind
+    return lfold_expr(y, self, deps);
+}
+
+// Optimize the body of 'f', bound to 'name' in the global environment
+void linline_function(char* name, lval* f) {
+    if (!linl.enabled || f->type != LVAL_FUN || f->builtin) { return; }
+    int prev = lspace_set(0);
+
+    // the body is evaluated as one S-Expression
+    int budget = LINLINE_BUDGET;
+    lval* deps = lval_qexpr();
+    lval* body = lval_own(lval_copy(f->body));
+    body->type = LVAL_SEXPR;
+    body = linline_expr(body, f->formals, name, deps, &budget);
+
+    // a body folded down to a constant evaluates to it as the only cell
+    if (body->type == LVAL_SEXPR) { body->type = LVAL_QEXPR; }
+    else { body = lval_add(lval_qexpr(), body); }
+
+    if (deps->count == 0) {
+        lval_del(body);
+        lval_del(deps);
+        lspace_set(prev);
+        return;
+    }
+
+    int i = linl.count++;
+    linl.names = realloc(linl.names, sizeof(char*) * linl.count);
+    linl.sources = realloc(linl.sources, sizeof(lval*) * linl.count);
+    linl.deps = realloc(linl.deps, sizeof(lval*) * linl.count);
+    linl.names[i] = malloc(strlen(name) + 1);
+    strcpy(linl.names[i], name);
+    linl.sources[i] = f->body;
+    linl.deps[i] = deps;
+    f->body = lval_intern(body);
+    lspec_attach(f);
+    ljit_attach(name, f);
+    lspace_set(prev);
+}
+
+// Forget optimized function 'i', giving it back its original body
+// unless it is no longer bound
+void linline_restore(int i, int unbound) {
+    lval* f = unbound ? NULL : lenv_find(linl.root, linl.names[i]);
+    if (f) {
+        lval_del(f->body);
+        f->body = linl.sources[i];
+        lspec_attach(f);
+        ljit_attach(linl.names[i], f);
+    } else {
+        lval_del(linl.sources[i]);
+    }
+    lval_del(linl.deps[i]);
+    free(linl.names[i]);
+
+    linl.count--;
+    linl.names[i] = linl.names[linl.count];
+    linl.sources[i] = linl.sources[linl.count];
+    linl.deps[i] = linl.deps[linl.count];
+}
+
+// Undo and redo every function that inlined 's', and try again on
+// those that call it
+void linline_invalidate(char* s) {
+    int prev = lspace_set(0);
+    for (int i = 0; i < linl.count; ) {
+        if (lval_mentions(linl.deps[i], s)) { linline_restore(i, 0); }
+        else { i++; }
+    }
+
+    // callers come after their helpers in the global environment,
+    // which is therefore the order to optimize them again in
+    lenv* e = linl.root;
+    for (int i = 0; i < e->count; i++) {
+        if (e->vals[i]->type == LVAL_FUN && !e->vals[i]->builtin
+            && linline_record(e->syms[i]) < 0
+            && lval_mentions(e->vals[i]->body, s)) {
+            linline_function(e->syms[i], e->vals[i]);
+        }
+    }
+    lspace_set(prev);
+}
+
+// Called once 'v' has been bound to 'name' in the global environment
+void linline_rebound(char* name, lval* v) {
+    int r = linline_record(name);
+    if (r >= 0) { linline_restore(r, 1); }
+    linline_invalidate(name);
+    linline_function(name, v);
+}
+
+// Called when 'name' is about to be bound locally
+void linline_shadow(char* name) {
+    if (linline_is_shadowed(name)) { return; }
+    int prev = lspace_set(0);
+    if (!linl.shadowed) { linl.shadowed = lmap_new(1); }
+    lmap_put(linl.shadowed, lval_sym(name), NULL);
+    lic.version++;
+    ljit_rebound(name);
+    if (linl.root) { linline_invalidate(name); }
+    lspace_set(prev);
+}
+
+char* ltype_name(int t) {
+    switch (t){
+        case LVAL_NUM: return "Number";
+        case LVAL_DBL: return "Float";
+        case LVAL_VEC: return "Vector";
+        case LVAL_MAP: return "Map";
+        case LVAL_SET: return "Set";
+        case LVAL_STR: return "String";
+        case LVAL_SEXPR: return "S-Expression";
+        case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_FUN: return "Function";
+        case LVAL_SYM: return "Symbol";
+        case LVAL_ERR: return "Error";
+        default: return "Unknown";
+    }
+}
+lval* builtin_head(lenv* e, lval* a) {
+
+    LASSERT(a, a->count == 1,
+        "Function 'head' passed too many arguments!"
+        "Got %i, Expected %i.",
+        a->count, 1);
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+        "Function 'head' passed incorrect type for argument 0. "
+        "Got %s, Expected %s",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, a->cell[0]->count != 0,
+        "Function 'head' passed {}!");
+
+    //otherwise we take the first argument
+    lval* v = lval_own(lval_take(a, 0));
+
+    //delete all elements that are not head and return
+    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+    return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+
+    LASSERT(a, a->count == 1,
+        "Function 'tail' passed too many arguments!"
+        "Got %i, Expected %i.",
+        a->count, 1);
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+        "Function 'tail' passed incorrect type for argument 0. "
+        "Got %s, Expected %s",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, a->cell[0]->count != 0,
+        "Function 'tail' passed {}!");
+    //Take first argument
+    lval* v = lval_own(lval_take(a, 0));
+
+    //Delete first element and return
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1,
+            "Function 'eval' passed too many arguments!"
+            "Got %i, Expected %i.",
+            a->count, 1);
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+            "Function 'eval' passed incorrect type for argument 0. "
+            "Got %s, Expected %s",
+            ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+    lval* x = lval_own(lval_take(a, 0));
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+lval* lval_join (lval* x, lval* y) {
+
+    y = lval_own(y);
+
+    // move all the cells of 'y' over to 'x' in one go
+    x->cell = lmem_realloc(x->arena, x->cell,
+        sizeof(lval*) * (x->count + y->count));
+    memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+    x->count += y->count;
+    y->count = 0;
+
+    //delete the empty 'y' and return 'x'
+    lval_del(y);
+    return x;
+}
+
+// Macros
+//
+// A macro is a function from code to code, kept apart from the
+// environment. Its calls are expanded once: in a lambda body when the
+// lambda is made, and in a top-level form when the form is read, so
+// running the code costs nothing for the macro. Each argument is passed
+// unevaluated as a Q-Expression holding it. A Q-Expression result is
+// put in place of the call as the S-Expression to run, any other result
+// as it is. Q-Expressions are data, so calls inside them are left alone.
+
+enum { LMACRO_DEPTH = 64 };
+
+lenv* lmacros = NULL;
+
+lval* lval_call(lenv* e, lval* f, lval* v);
+void lval_annotate(lval* x);
+
+// Expand the macro calls in 'x', taking ownership of it. 'depth'
+// counts the expansions this one was produced by.
+lval* lmacro_expand(lval* x, int depth) {
+    if (!lmacros || x->type != LVAL_SEXPR) { return x; }
+
+    lval* m = NULL;
+    if (x->count && x->cell[0]->type == LVAL_SYM) {
+        m = lenv_find(lmacros, x->cell[0]->sym);
+    }
+    if (m) {
+        if (depth == LMACRO_DEPTH) {
+            lval* err = lval_err("Macro '%s' expands too deeply.", x->cell[0]->sym);
+            lval_del(x);
+            return err;
+        }
+
+        lval* args = lval_sexpr();
+        for (int i = 1; i < x->count; i++) {
+            lval_add(args, lval_add(lval_qexpr(), lval_copy(x->cell[i])));
+        }
+        lval_del(x);
+
+        // run in the global environment, whatever the code ends up in
+        lval* f = lval_copy(m);
+        lval* r = lval_call(linl.root, f, args);
+        lval_del(f);
+        if (r->type == LVAL_QEXPR) {
+            r = lval_own(r);
+            r->type = LVAL_SEXPR;
+            lval_annotate(r);
+        }
+        return r->type == LVAL_ERR ? r : lmacro_expand(r, depth + 1);
+    }
+
+    // an error the reader left is reported when it is evaluated, as it
+    // is without macros, and the expressions around it still expand
+    x = lval_own(x);
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i]->type == LVAL_ERR) { continue; }
+        x->cell[i] = lmacro_expand(x->cell[i], depth);
+        if (x->cell[i]->type == LVAL_ERR) { return lval_take(x, i); }
+    }
+    return x;
+}
+
+// Expand the macro calls in the lambda body 'body', which is evaluated
+// as one S-Expression
+lval* lmacro_body(lval* body) {
+    if (!lmacros) { return body; }
+    body = lval_own(body);
+    body->type = LVAL_SEXPR;
+    body = lmacro_expand(body, 0);
+    if (body->type == LVAL_ERR) { return body; }
+
+    if (body->type == LVAL_SEXPR) { body->type = LVAL_QEXPR; }
+    else { body = lval_add(lval_qexpr(), body); }
+    return body;
+}
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+
+    lval* sig = a->cell[0];
+    LASSERT(a, sig->count >= 1,
+        "Function 'defmacro' passed no name. Expected {name formals...}.");
+    for (int i = 0; i < sig->count; i++) {
+        LASSERT(a, (sig->cell[i]->type == LVAL_SYM),
+        "Cannot define non-symbol. Got %s, Expected %s.",
+        ltype_name(sig->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    // the formals are bound locally whenever the macro runs
+    for (int i = 1; i < sig->count; i++) {
+        linline_shadow(sig->cell[i]->sym);
+    }
+
+    lval* formals = lval_own(lval_pop(a, 0));
+    lval* name = lval_pop(formals, 0);
+    lval* body = lmacro_body(lval_pop(a, 0));
+    lval_del(a);
+    if (body->type == LVAL_ERR) {
+        lval_del(formals);
+        lval_del(name);
+        return body;
+    }
+
+    if (!lmacros) {
+        int prev = lspace_set(0);
+        lmacros = lenv_new();
+        lspace_set(prev);
+    }
+    lenv_put_move(lmacros, name, lval_lambda(formals, body));
+    lval_del(name);
+    return lval_sexpr();
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+
+    // Check Two arguments, each of which are Q-Expressions
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("LASSERT_TYPE", a, 1, LVAL_QEXPR);
+
+    // check first Q-Expression contains only symbols
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        "Cannot define non-symbol. Got %s, Expected %s.",
+        ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    // formals are local bindings, which globals of the same name must
+    // not be inlined past
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        linline_shadow(a->cell[0]->cell[i]->sym);
+    }
+
+    //Pop first two arguments and pass them to lval_lambda
+    lval* formals = lval_pop(a, 0);
+    lval* body = lmacro_body(lval_pop(a, 0));
+    lval_del(a);
+    if (body->type == LVAL_ERR) {
+        lval_del(formals);
+        return body;
+    }
+
+    return lval_lambda(formals, body);
+
+
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+                "Function 'eval' passed incorrect type for argument 0. "
+                "Got %s, Expected %s",
+                ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+    }
+
+    lval* x = lval_own(lval_pop(a, 0));
+
+    while (a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval * builtin_op(lenv* e, lval* a, char* op) {
+
+    //Ensure all arguments are numbers, noting whether any is a float
+    int flt = 0;
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type == LVAL_DBL) { flt = 1; continue; }
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("Cannot operate on non-number!");
+        }
+    }
+
+    //pop the first element, promoting it if the result will be a float
+    lval* x = lval_own(lval_pop(a, 0));
+    if (flt && x->type == LVAL_NUM) {
+        x->type = LVAL_DBL;
+        x->dbl = (double)x->num;
+    }
+
+    //if no arguments and sub then perform unary negation
+    if (strcmp(op, "-") == 0 && a->count == 0) {
+        if (flt) { x->dbl = -x->dbl; } else { x->num = -x->num; }
+    }
+
+    //while there are still elements remaining
+    while (a->count > 0) {
+
+        //pop the next element
+        lval* y = lval_pop(a, 0);
+
+        if (flt) {
+            double d = y->type == LVAL_DBL ? y->dbl : (double)y->num;
+            if (strcmp(op, "+") == 0) { x->dbl += d; }
+            if (strcmp(op, "-") == 0) { x->dbl -= d; }
+            if (strcmp(op, "*") == 0) { x->dbl *= d; }
+            if (strcmp(op, "/") == 0) {
+                if (d == 0) {
+                    lval_del(x); lval_del(y);
+                    x = lval_err("Division by Zero!"); break;
+                }
+                x->dbl /= d;
+            }
+            lval_del(y);
+            continue;
+        }
+
+        if (strcmp(op, "+") == 0) { x->num += y->num; }
+        if (strcmp(op, "-") == 0) { x->num -= y->num; }
+        if (strcmp(op, "*") == 0) { x->num *= y->num; }
+        if (strcmp(op, "/") == 0) {
+            if (y->num == 0) {
+                lval_del(x); lval_del(y);
+                x = lval_err("Division by Zero!"); break;
+            }
+            x->num /= y->num;
+        }
+
+        lval_del(y);
+
+    }
+
+    lval_del(a);
+    return x;
+
+}
+
+lval * builtin_op(lenv* e, lval* a, char* op);
+
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, "/");
+}
+
+lval* builtin(lenv* e, lval* a, char* func) {
+    if (strcmp("list", func) == 0) {return builtin_list(e, a);}
+    if (strcmp("head", func) == 0) {return builtin_head(e, a);}
+    if (strcmp("tail", func) == 0) {return builtin_tail(e, a);}
+    if (strcmp("join", func) == 0) {return builtin_join(e, a);}
+    if (strcmp("eval", func) == 0) {return builtin_eval(e, a);}
+    if (strstr("+-/*", func)) {return builtin_op(e, a, func);}
+    lval_del(a);
+    return lval_err("Unknown Function!");
+}
+
+// Speculative arithmetic
+//
+// Arithmetic expressions in the body of a globally bound lambda get a
+// slot recording what they have been applied to. Once one has seen only
+// integers for a few evaluations it runs speculatively: a guard on the
+// callee and on each operand, then a straight-line loop with checked
+// overflow instead of the generic builtin. When a guard fails or the
+// result would overflow the expression deoptimizes to the generic path
+// for good.
+//
+// Heap copies of an expression hold a reference to its slot, which is
+// reused once the last of them is swept. Arena copies hold none: the
+// slot may be reused under them, which only costs a deoptimization as
+// the guards still decide what runs.
+
+enum { LSPEC_WARMUP = 2 };
+
+enum { LSPEC_COLD, LSPEC_INT, LSPEC_GENERIC };
+
+typedef struct {
+    int state;
+    int seen;
+    int refs;
+    lbuiltin op;
+} lspec_site_t;
+
+typedef struct {
+    int enabled;
+    int count;
+    lspec_site_t* sites;
+    int free_num;
+    int* free;
+    long hits;
+    long deopts;
+} lspec_t;
+
+lspec_t lspec = { 1, 0, NULL, 0, NULL, 0, 0 };
+
+// Slot for 'x' when it applies an arithmetic builtin, or 0
+int lspec_site(lval* x) {
+    if (x->count < 2 || x->cell[0]->type != LVAL_SYM) { return 0; }
+    char* op = x->cell[0]->sym;
+    if (strcmp(op, "+") && strcmp(op, "-") && strcmp(op, "*")) { return 0; }
+
+    int i;
+    if (lspec.free_num) { i = lspec.free[--lspec.free_num]; }
+    else {
+        i = lspec.count++;
+        lspec.sites = realloc(lspec.sites, sizeof(lspec_site_t) * lspec.count);
+        lspec.free = realloc(lspec.free, sizeof(int) * lspec.count);
+    }
+    lspec.sites[i].state = LSPEC_COLD;
+    lspec.sites[i].seen = 0;
+    lspec.sites[i].refs = 1;
+    lspec.sites[i].op = NULL;
+    return i + 1;
+}
+
+// Slot for a copy of an expression with slot 'site', taking a reference
+// unless the copy lives in an arena. A slot already freed is not
+// revived.
+int lspec_site_ref(int site, int arena) {
+    if (!site || arena) { return site; }
+    if (lspec.sites[site - 1].refs == 0) { return 0; }
+    lspec.sites[site - 1].refs++;
+    return site;
+}
+
+void lspec_site_unref(int site) {
+    if (!site || --lspec.sites[site - 1].refs > 0) { return; }
+    lspec.free[lspec.free_num++] = site - 1;
+}
+
+void lspec_attach_expr(lval* x) {
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return; }
+    for (int i = 0; i < x->count; i++) { lspec_attach_expr(x->cell[i]); }
+    if (!x->site) { x->site = lspec_site(x); }
+}
+
+// Give the arithmetic in the body of 'f', just bound globally, slots.
+// Q-Expressions within it are included as they are often code too.
+void lspec_attach(lval* f) {
+    if (f->type != LVAL_FUN || f->builtin || f->body->arena) { return; }
+    lspec_attach_expr(f->body);
+}
+
+// Record the callee and operand types of a generic evaluation
+void lspec_profile(lspec_site_t* s, lval* v) {
+    if (v->cell[0]->type != LVAL_FUN) { s->state = LSPEC_GENERIC; return; }
+    lbuiltin op = v->cell[0]->builtin;
+    if (op != builtin_add && op != builtin_sub && op != builtin_mul) {
+        s->state = LSPEC_GENERIC;
+        return;
+    }
+    if (s->op && s->op != op) { s->state = LSPEC_GENERIC; return; }
+    s->op = op;
+
+    for (int i = 1; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_NUM) { s->state = LSPEC_GENERIC; return; }
+    }
+    if (++s->seen >= LSPEC_WARMUP) { s->state = LSPEC_INT; }
+}
+
+// Evaluate the evaluated expression 'v' on the assumption it is integer
+// arithmetic, or deoptimize and return NULL
+lval* lspec_int(lspec_site_t* s, lval* v) {
+    if (v->cell[0]->type != LVAL_FUN || v->cell[0]->builtin != s->op) {
+        goto deopt;
+    }
+    for (int i = 1; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_NUM) { goto deopt; }
+    }
+
+    long long x = v->cell[1]->num;
+    if (s->op == builtin_add) {
+        for (int i = 2; i < v->count; i++) {
+            if (__builtin_add_overflow(x, v->cell[i]->num, &x)) { goto deopt; }
+        }
+    }
+    else if (s->op == builtin_mul) {
+        for (int i = 2; i < v->count; i++) {
+            if (__builtin_mul_overflow(x, v->cell[i]->num, &x)) { goto deopt; }
+        }
+    }
+    else if (v->count == 2) {
+        if (__builtin_sub_overflow(0, x, &x)) { goto deopt; }
+    }
+    else {
+        for (int i = 2; i < v->count; i++) {
+            if (__builtin_sub_overflow(x, v->cell[i]->num, &x)) { goto deopt; }
+        }
+    }
+
+    lspec.hits++;
+    return lval_num(x);
+
+deopt:
+    s->state = LSPEC_GENERIC;
+    lspec.deopts++;
+    return NULL;
+}
+
+// JIT
+//
+// Globally bound lambdas count their calls, and one called often enough
+// is compiled to x86-64 machine code if its body is integer arithmetic
+// on its formals and constants. Each form has a fixed template working
+// on the machine stack, so the code is a direct transcription of the
+// body. Anything else, such as a float argument or a body calling
+// other functions, keeps running in the interpreter.
+//
+// A slot belongs to one body: rebinding a function, or the inliner
+// rewriting it, gives it a new slot. Every copy of the function holds a
+// reference to the slot, through its arena for arena copies, and the
+// last one to go unmaps the code and frees the slot for reuse. Compiled
+// code assumes '+', '-' and '*' are the builtins, so it is compiled
+// again after one of them has been bound globally or shadowed. Every
+// compiled function is entered in /tmp/perf-<pid>.map so that perf can
+// name it.
+//
+// A slot may also hold native code that lispyc compiled ahead of time.
+// It runs while the JIT is off, and only until the operators move on
+// from the version it was attached at.
+
+#if defined(__x86_64__) && defined(__linux__)
+#define LJIT_X86
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum { LJIT_THRESHOLD = 1000, LJIT_ARGS = 16 };
+
+typedef long long (*ljit_code)(long long* args);
+
+typedef struct {
+    char* name;
+    long calls;
+
+    // operator version the code was compiled against, 0 if never tried
+    long version;
+    ljit_code code;
+    size_t size;
+    int argc;
+
+    // code compiled ahead of time, and the operator version it holds for
+    ljit_code native;
+    long native_version;
+
+    int refs;
+} ljit_fn_t;
+
+typedef struct {
+    int enabled;
+    long threshold;
+    int count;
+    ljit_fn_t* fns;
+
+    // moves on whenever '+', '-' or '*' is bound globally or shadowed
+    long version;
+
+    // slots free for reuse
+    int free_num;
+    int* free;
+
+    long compiled;
+    long calls;
+    long fallbacks;
+    FILE* perf;
+} ljit_t;
+
+ljit_t ljit = { 0, LJIT_THRESHOLD, 0, NULL, 1, 0, NULL, 0, 0, 0, NULL };
+
+// Called when 'name' is bound globally or about to be bound locally
+void ljit_rebound(char* name) {
+    if (strcmp(name, "+") == 0 || strcmp(name, "-") == 0
+        || strcmp(name, "*") == 0) { ljit.version++; }
+}
+
+void ljit_unmap(ljit_fn_t* j) {
+    #ifdef LJIT_X86
+    if (j->code) { munmap((void*)j->code, j->size); }
+    #endif
+    j->code = NULL;
+    j->size = 0;
+}
+
+// Slot for a copy of a function with slot 'jit', taking a reference
+// that the arena drops if the copy lives in one
+int ljit_ref(int jit, int arena) {
+    if (!jit) { return 0; }
+    ljit.fns[jit - 1].refs++;
+    if (arena) { larena_hold(larena_live, LHOLD_JIT, (void*)(size_t)jit); }
+    return jit;
+}
+
+void ljit_unref(int jit) {
+    if (!jit) { return; }
+    ljit_fn_t* j = &ljit.fns[jit - 1];
+    if (--j->refs > 0) { return; }
+    ljit_unmap(j);
+    free(j->name);
+    j->name = NULL;
+    ljit.free[ljit.free_num++] = jit - 1;
+}
+
+// Give the lambda 'f', just bound globally as 'name', a fresh slot
+void ljit_attach(char* name, lval* f) {
+    ljit_rebound(name);
+    if (f->type != LVAL_FUN || f->builtin) { return; }
+    ljit_unref(f->jit);
+
+    int i;
+    if (ljit.free_num) { i = ljit.free[--ljit.free_num]; }
+    else {
+        i = ljit.count++;
+        ljit.fns = realloc(ljit.fns, sizeof(ljit_fn_t) * ljit.count);
+        ljit.free = realloc(ljit.free, sizeof(int) * ljit.count);
+    }
+    ljit.fns[i].name = malloc(strlen(name) + 1);
+    strcpy(ljit.fns[i].name, name);
+    ljit.fns[i].calls = 0;
+    ljit.fns[i].version = 0;
+    ljit.fns[i].code = NULL;
+    ljit.fns[i].size = 0;
+    ljit.fns[i].argc = 0;
+    ljit.fns[i].native = NULL;
+    ljit.fns[i].native_version = 0;
+    ljit.fns[i].refs = 1;
+    f->jit = i + 1;
+}
+
+// Builtin the global 'op' must be for a body using it to compile
+lbuiltin ljit_builtin(char* op) {
+    if (strcmp(op, "+") == 0) { return builtin_add; }
+    if (strcmp(op, "-") == 0) { return builtin_sub; }
+    if (strcmp(op, "*") == 0) { return builtin_mul; }
+    return NULL;
+}
+
+#ifdef LJIT_X86
+
+typedef struct {
+    unsigned char* buf;
+    int len;
+    int cap;
+} ljit_buf;
+
+void ljit_emit(ljit_buf* b, const void* code, int n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->buf = realloc(b->buf, b->cap);
+    }
+    memcpy(b->buf + b->len, code, n);
+    b->len += n;
+}
+
+int ljit_expr(ljit_buf* b, lval* x, lval* formals);
+
+// Emit code that pushes the value of the S-Expression 'x', or return 0
+int ljit_sexpr(ljit_buf* b, lval* x, lval* formals) {
+    if (x->count == 0) { return 0; }
+    if (x->count == 1) { return ljit_expr(b, x->cell[0], formals); }
+
+    if (x->cell[0]->type != LVAL_SYM) { return 0; }
+    char* op = x->cell[0]->sym;
+    lbuiltin f = ljit_builtin(op);
+    lval* g = f ? lenv_find(lic.root, op) : NULL;
+    if (!g || g->type != LVAL_FUN || g->builtin != f
+        || linline_is_shadowed(op)) {
+        return 0;
+    }
+
+    // pop rcx; pop rax; <op> rax, rcx; push rax
+    static const unsigned char add[] = { 0x59, 0x58, 0x48, 0x01, 0xC8, 0x50 };
+    static const unsigned char sub[] = { 0x59, 0x58, 0x48, 0x29, 0xC8, 0x50 };
+    static const unsigned char mul[] = { 0x59, 0x58, 0x48, 0x0F, 0xAF, 0xC1, 0x50 };
+    // pop rax; neg rax; push rax
+    static const unsigned char neg[] = { 0x58, 0x48, 0xF7, 0xD8, 0x50 };
+
+    if (!ljit_expr(b, x->cell[1], formals)) { return 0; }
+    if (x->count == 2 && f == builtin_sub) { ljit_emit(b, neg, sizeof(neg)); }
+    for (int i = 2; i < x->count; i++) {
+        if (!ljit_expr(b, x->cell[i], formals)) { return 0; }
+        if (f == builtin_add) { ljit_emit(b, add, sizeof(add)); }
+        if (f == builtin_sub) { ljit_emit(b, sub, sizeof(sub)); }
+        if (f == builtin_mul) { ljit_emit(b, mul, sizeof(mul)); }
+    }
+    return 1;
+}
+
+// Emit code that pushes the value of 'x', or return 0
+int ljit_expr(ljit_buf* b, lval* x, lval* formals) {
+    if (x->type == LVAL_NUM) {
+        // mov rax, imm64; push rax
+        unsigned char code[11] = { 0x48, 0xB8 };
+        memcpy(code + 2, &x->num, 8);
+        code[10] = 0x50;
+        ljit_emit(b, code, sizeof(code));
+        return 1;
+    }
+    if (x->type == LVAL_SYM) {
+        int i = linline_formal(formals, x->sym);
+        if (i < 0) { return 0; }
+
+        // mov rax, [rdi + 8*i]; push rax
+        int disp = 8 * i;
+        unsigned char code[8] = { 0x48, 0x8B, 0x87 };
+        memcpy(code + 3, &disp, 4);
+        code[7] = 0x50;
+        ljit_emit(b, code, sizeof(code));
+        return 1;
+    }
+    if (x->type == LVAL_SEXPR) { return ljit_sexpr(b, x, formals); }
+    return 0;
+}
+
+// Compile 'f' for slot 'j', leaving its code NULL if it cannot be
+void ljit_compile(ljit_fn_t* j, lval* f) {
+    j->version = ljit.version;
+    ljit_unmap(j);
+
+    // plain formals only, each named once
+    lval* formals = f->formals;
+    if (formals->count > LJIT_ARGS) { return; }
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) { return; }
+        if (ljit_builtin(formals->cell[i]->sym)) { return; }
+        if (linline_formal(formals, formals->cell[i]->sym) != i) { return; }
+    }
+
+    // the body is evaluated as one S-Expression
+    ljit_buf b = { NULL, 0, 0 };
+    if (!ljit_sexpr(&b, f->body, formals)) { free(b.buf); return; }
+
+    // pop rax; ret
+    static const unsigned char ret[] = { 0x58, 0xC3 };
+    ljit_emit(&b, ret, sizeof(ret));
+
+    // written while writable, then made executable instead
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (b.len + page - 1) / page * page;
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) { free(b.buf); return; }
+    memcpy(code, b.buf, b.len);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        free(b.buf);
+        return;
+    }
+
+    if (!ljit.perf) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+        ljit.perf = fopen(path, "a");
+    }
+    if (ljit.perf) {
+        fprintf(ljit.perf, "%lx %x lispy:%s\n",
+            (unsigned long)code, b.len, j->name);
+        fflush(ljit.perf);
+    }
+
+    free(b.buf);
+    j->code = (ljit_code)code;
+    j->size = size;
+    j->argc = formals->count;
+    ljit.compiled++;
+}
+
+#else
+
+void ljit_compile(ljit_fn_t* j, lval* f) {
+    j->version = ljit.version;
+}
+
+#endif
+
+// Unpack the arguments 'a' of 'f' for its code, or return 0
+int ljit_args(ljit_fn_t* j, lval* f, lval* a, long long* args) {
+    if (f->env->count || a->count != j->argc) { return 0; }
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type != LVAL_NUM) { return 0; }
+        args[i] = a->cell[i]->num;
+    }
+    return 1;
+}
+
+// Call 'f' through its compiled code, or return NULL to have the
+// interpreter do it
+lval* ljit_call(lval* f, lval* a) {
+    ljit_fn_t* j = &ljit.fns[f->jit - 1];
+    long long args[LJIT_ARGS];
+
+    // ahead-of-time code holds only while the operators do
+    if (!ljit.enabled) {
+        if (!j->native || j->native_version != ljit.version
+            || !ljit_args(j, f, a, args)) { return NULL; }
+        lval* x = lval_num(j->native(args));
+        lval_del(a);
+        return x;
+    }
+
+    // count calls until compiled against the current operators
+    if (j->version != ljit.version) {
+        if (++j->calls < ljit.threshold) { return NULL; }
+        j->calls = 0;
+        ljit_compile(j, f);
+    }
+    if (!j->code) { return NULL; }
+    if (!ljit_args(j, f, a, args)) { ljit.fallbacks++; return NULL; }
+
+    ljit.calls++;
+    lval* x = lval_num(j->code(args));
+    lval_del(a);
+    return x;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* v);
+
+lval* lval_eval_sexpr (lenv* e, lval* v) {
+
+    v = lval_own(v);
+    for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    if (v->count == 0) { return v; }
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    // arithmetic that has only seen integers skips the generic builtin
+    if (v->site && lspec.enabled) {
+        lspec_site_t* s = &lspec.sites[v->site - 1];
+        if (s->state == LSPEC_INT) {
+            lval* r = lspec_int(s, v);
+            if (r) { lval_del(v); return r; }
+        }
+        else if (s->state == LSPEC_COLD) { lspec_profile(s, v); }
+    }
+
+    //Ensure first element is a function after evaluation
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+        lval* err = lval_err(
+            "S-Expression starts with incorrect type. "
+            "Got %s, Expected %s.",
+            ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval_del(f); lval_del(v);
+        return err;
+    }
+
+    //If so call function to get result
+    lval* result = lval_call(e, f , v);
+    lval_del(f);
+    return result;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    lenv_put_move(e, k, v);
+    lval_del(k);
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    //if builtin then simply add that
+    if (f->builtin) { return f->builtin(e, a);}
+
+    // hot functions run as machine code when they can
+    if (f->jit && (ljit.enabled || ljit.fns[f->jit - 1].native)) {
+        lval* r = ljit_call(f, a);
+        if (r) { return r; }
+    }
+
+    // a non-escaping lambda given all its arguments at once runs in a
+    // pooled frame, leaving its own environment and formals untouched
+    if (f->noescape && lspace_arena && f->env->count == 0
+        && a->count == f->formals->count) {
+        lenv* fr = lframe_push(e);
+        for (int i = 0; i < a->count; i++) {
+            lenv_put_move(fr, f->formals->cell[i], a->cell[i]);
+        }
+        a->count = 0;
+        lval_del(a);
+
+        larena_mark_t m = larena_mark(larena_live);
+        lval* r = builtin_eval(
+            fr, lval_add(lval_sexpr(), lval_copy(f->body)));
+        lframe_pop();
+        return lgc_minor(m, r);
+    }
+
+    // the formals are consumed as they are bound
+    f->formals = lval_own(f->formals);
+
+    // record argument counts
+    int given = a->count;
+    int total = f->formals->count;
+
+    // while arguments remain unprocessed
+    while (a->count) {
+
+        //if we've ran out of formal arguments to bind
+        if (f->formals->count == 0) {
+           lval_del(a); return lval_err("Function passed too many arguments. "
+                   "Got %i, Expected %i", given, total);
+        }
+
+        // pop the first symbol from the formals
+        lval* sym = lval_pop(f->formals, 0);
+
+        // pop the next argument from the list
+        lval* val = lval_pop(a, 0);
+
+        // bind the value itself into the functions environment
+        lenv_put_move(f->env, sym, val);
+
+        // delete symbol
+        lval_del(sym);
+    }
+
+    // argument list is now bound so can be cleaned up
+    lval_del(a);
+
+    // if all formals have been bound to evaluate
+    if (f->formals->count == 0) {
+
+        //set environment parent to evaluation environment
+        f->env->par = e;
+
+        // evaluate and return, collecting whatever the body left
+        // behind in the nursery if it has filled up
+        if (!lspace_arena) {
+            return builtin_eval(
+                f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        }
+        larena_mark_t m = larena_mark(larena_live);
+        lval* r = builtin_eval(
+            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        return lgc_minor(m, r);
+    }
+    else {
+        // otherwise return partially evaluated function
+        return lval_copy(f);
+    }
+}
+
+lval* builtin_var (lenv* e, lval* a, char* func) {
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+            "Function '%s' cannot define non-symbol. "
+            "Got %s, Expected %s.", func,
+            ltype_name(syms->cell[i]->type),
+            ltype_name(LVAL_SYM));
+    }
+
+    LASSERT(a, syms->count == a->count -1,
+        "Function '%s' passed too many arguments for symbols. "
+        "Got %i, Expected %i. ", func, syms->count, a->count-1);
+
+    // the values are moved out of the arguments as they are bound
+    syms = lval_pop(a, 0);
+    for (int i = 0; i < syms->count; i++) {
+        lval* v = lval_pop(a, 0);
+        //if 'def' define in globally. If 'put' define in locally
+        if (strcmp(func, "def") == 0) {
+            lenv_def_move(e, syms->cell[i], v);
+        }
+        if (strcmp(func, "=") == 0) {
+            if (!lenv_is_root(e)) { linline_shadow(syms->cell[i]->sym); }
+            lenv_put_move(e, syms->cell[i], v);
+        }
+    }
+
+    lval_del(syms);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_def (lenv* e, lval* a) {
+    return builtin_var(e, a, "def");
+}
+
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=");
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+
+    // print each argument followed by a space, bar the last
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]);
+        if (i != a->count - 1) { fputc(' ', lout); }
+    }
+    fputc('\n', lout);
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// Parsers, shared by the prompt and 'load'
+mpc_parser_t* Number;
+mpc_parser_t* String;
+mpc_parser_t* Symbol;
+mpc_parser_t* Sexpr;
+mpc_parser_t* Qexpr;
+mpc_parser_t* Expr;
+mpc_parser_t* Lispy;
+
+void lispy_parsers(void) {
+    // Create some parsers
+    Number = mpc_new("number");
+    String = mpc_new("string");
+    Symbol = mpc_new("symbol");
+    Sexpr = mpc_new("sexpr");
+    Qexpr = mpc_new("qexpr");
+    Expr = mpc_new("expr");
+    Lispy = mpc_new("lispy");
+
+    // Strings use mpc's own literal parser rather than a regex
+    mpc_define(String, mpc_apply(mpc_tok(mpc_string_lit()), mpcf_str_ast));
+
+    // Define them with the following language
+    mpca_lang(MPCA_LANG_DEFAULT,
+            " \
+            number: /-?[0-9]+(\\.[0-9]+)?/; \
+            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/; \
+            sexpr: '(' <expr>* ')'; \
+            qexpr: '{' <expr>* '}'; \
+            expr: <number> | <string> | <symbol> | <sexpr> | <qexpr> ;\
+            lispy : /^/ <expr>* /$/ ; \
+            ",
+            Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+}
+
+lval* lmacro_expand(lval* x, int depth);
+
+// Evaluate every top-level expression of a file in order. Errors go
+// to stderr, so that stdout only carries what the program prints.
+// Each one is also counted in lload_failed, so that running a script
+// ends with a failure status when any of its expressions failed.
+// The file is streamed through the parser a chunk at a time and each
+// expression runs as soon as it has been read, so a generated program
+// of any size loads in the memory of its largest expression.
+#define LOAD_CHUNK 4096
+
+long lload_failed = 0;
+
+// Read the next expression of file 'f' through stream 's', feeding it
+// more of the file as needed. Returns 0 at the end of the file, or on
+// a syntax error with r->error set.
+int lload_next(mpc_stream_t* s, FILE* f, char* chunk, mpc_result_t* r) {
+    while (!mpc_stream_next(s, r)) {
+        if (r->error || feof(f) || ferror(f)) { return 0; }
+        size_t n = fread(chunk, 1, LOAD_CHUNK, f);
+        mpc_stream_feed(s, chunk, n);
+        if (n < LOAD_CHUNK) { mpc_stream_finish(s); }
+    }
+    return 1;
+}
+
+lval* lload_err(mpc_err_t* r) {
+    char* err_msg = mpc_err_string(r);
+    err_msg[strcspn(err_msg, "\n")] = '\0';
+    mpc_err_delete(r);
+    lval* err = lval_err("Could not load Library %s", err_msg);
+    free(err_msg);
+    return err;
+}
+
+// Evaluate an expression read by lload_next, deleting its tree
+lval* lload_eval(lenv* e, mpc_ast_t* t) {
+    lval* x = lval_read(t);
+    mpc_ast_delete(t);
+    return lval_eval(e, lmacro_expand(x, 0));
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    // compiled programs only build the parsers once they need them
+    if (!Lispy) { lispy_parsers(); }
+
+    char* filename = lval_str_flat(a->cell[0]);
+    lval_del(a);
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        lval* err = lval_err("Could not load Library %s: error: Unable to open file!", filename);
+        free(filename);
+        return err;
+    }
+
+    mpc_stream_t* s = mpc_stream_new(filename, Expr, (mpc_dtor_t)mpc_ast_delete);
+    free(filename);
+    char* chunk = malloc(LOAD_CHUNK);
+
+    larena_mark_t m;
+    if (lspace_arena) { m = larena_mark(larena_live); }
+    mpc_result_t r;
+    while (lload_next(s, f, chunk, &r)) {
+        lval* x = lload_eval(e, r.output);
+        if (x->type == LVAL_ERR) {
+            fprintf(stderr, "Error: %s\n", x->err);
+            lload_failed++;
+        }
+        lval_del(x);
+
+        // nothing the expressions so far allocated in the nursery is
+        // live any more, so it is collected as a whole once due, and
+        // the sweeper gets the pause the prompt would give it
+        if (lspace_arena) { lval_del(lgc_minor(m, lval_sexpr())); }
+        lsweep_run(-1, lgc_now() + lgc.max_pause);
+    }
+
+    free(chunk);
+    mpc_stream_delete(s);
+    fclose(f);
+    return r.error ? lload_err(r.error) : lval_sexpr();
+}
+
+// Vector Kernels
+//
+// Every packed vector builtin bottoms out in one of the kernels below.
+// The portable set is always available. On x86-64 an AVX2 set is
+// compiled alongside it and lvec_init picks it when the CPU supports it.
+// Binary kernels take a step for 'b' so that a step of 0 broadcasts
+// a single scalar across the whole vector.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LVEC_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    char* name;
+    void (*add_i64)(long long* r, long long* a, long long* b, int bstep, int n);
+    void (*mul_i64)(long long* r, long long* a, long long* b, int bstep, int n);
+    void (*add_f64)(double* r, double* a, double* b, int bstep, int n);
+    void (*mul_f64)(double* r, double* a, double* b, int bstep, int n);
+    long long (*sum_i64)(long long* a, int n);
+    double (*sum_f64)(double* a, int n);
+    long long (*dot_i64)(long long* a, long long* b, int n);
+    double (*dot_f64)(double* a, double* b, int n);
+    long long (*min_i64)(long long* a, int n);
+    long long (*max_i64)(long long* a, int n);
+    double (*min_f64)(double* a, int n);
+    double (*max_f64)(double* a, int n);
+} lvec_kernels;
+
+void lvec_add_i64_c(long long* r, long long* a, long long* b, int bstep, int n) {
+    for (int i = 0; i < n; i++) { r[i] = a[i] + b[i * bstep]; }
+}
+
+void lvec_mul_i64_c(long long* r, long long* a, long long* b, int bstep, int n) {
+    for (int i = 0; i < n; i++) { r[i] = a[i] * b[i * bstep]; }
+}
+
+void lvec_add_f64_c(double* r, double* a, double* b, int bstep, int n) {
+    for (int i = 0; i < n; i++) { r[i] = a[i] + b[i * bstep]; }
+}
+
+void lvec_mul_f64_c(double* r, double* a, double* b, int bstep, int n) {
+    for (int i = 0; i < n; i++) { r[i] = a[i] * b[i * bstep]; }
+}
+
+long long lvec_sum_i64_c(long long* a, int n) {
+    long long s = 0;
+    for (int i = 0; i < n; i++) { s += a[i]; }
+    return s;
+}
+
+double lvec_sum_f64_c(double* a, int n) {
+    double s = 0;
+    for (int i = 0; i < n; i++) { s += a[i]; }
+    return s;
+}
+
+long long lvec_dot_i64_c(long long* a, long long* b, int n) {
+    long long s = 0;
+    for (int i = 0; i < n; i++) { s += a[i] * b[i]; }
+    return s;
+}
+
+double lvec_dot_f64_c(double* a, double* b, int n) {
+    double s = 0;
+    for (int i = 0; i < n; i++) { s += a[i] * b[i]; }
+    return s;
+}
+
+long long lvec_min_i64_c(long long* a, int n) {
+    long long m = a[0];
+    for (int i = 1; i < n; i++) { if (a[i] < m) { m = a[i]; } }
+    return m;
+}
+
+long long lvec_max_i64_c(long long* a, int n) {
+    long long m = a[0];
+    for (int i = 1; i < n; i++) { if (a[i] > m) { m = a[i]; } }
+    return m;
+}
+
+double lvec_min_f64_c(double* a, int n) {
+    double m = a[0];
+    for (int i = 1; i < n; i++) { if (a[i] < m) { m = a[i]; } }
+    return m;
+}
+
+double lvec_max_f64_c(double* a, int n) {
+    double m = a[0];
+    for (int i = 1; i < n; i++) { if (a[i] > m) { m = a[i]; } }
+    return m;
+}
+
+lvec_kernels lvec_portable = {
+    "portable",
+    lvec_add_i64_c, lvec_mul_i64_c, lvec_add_f64_c, lvec_mul_f64_c,
+    lvec_sum_i64_c, lvec_sum_f64_c, lvec_dot_i64_c, lvec_dot_f64_c,
+    lvec_min_i64_c, lvec_max_i64_c, lvec_min_f64_c, lvec_max_f64_c
+};
+
+#ifdef LVEC_X86
+
+#define LVEC_AVX2 __attribute__((target("avx2")))
+
+// AVX2 has no 64 bit multiply so build one out of 32 bit products
+LVEC_AVX2 static inline __m256i lvec_mullo_epi64(__m256i a, __m256i b) {
+    __m256i bswap = _mm256_shuffle_epi32(b, 0xB1);
+    __m256i prodlh = _mm256_mullo_epi32(a, bswap);
+    __m256i prodlh2 = _mm256_hadd_epi32(prodlh, _mm256_setzero_si256());
+    __m256i prodlh3 = _mm256_shuffle_epi32(prodlh2, 0x73);
+    __m256i prodll = _mm256_mul_epu32(a, b);
+    return _mm256_add_epi64(prodll, prodlh3);
+}
+
+LVEC_AVX2 static inline long long lvec_hsum_epi64(__m256i v) {
+    long long t[4];
+    _mm256_storeu_si256((__m256i*)t, v);
+    return t[0] + t[1] + t[2] + t[3];
+}
+
+LVEC_AVX2 static inline double lvec_hsum_pd(__m256d v) {
+    double t[4];
+    _mm256_storeu_pd(t, v);
+    return (t[0] + t[1]) + (t[2] + t[3]);
+}
+
+LVEC_AVX2 void lvec_add_i64_avx2(long long* r, long long* a, long long* b, int bstep, int n) {
+    int i = 0;
+    __m256i s = _mm256_set1_epi64x(b[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256i y = bstep ? _mm256_loadu_si256((__m256i*)(b + i)) : s;
+        __m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+        _mm256_storeu_si256((__m256i*)(r + i), _mm256_add_epi64(x, y));
     }
+    for (; i < n; i++) { r[i] = a[i] + b[i * bstep]; }
+}
 
-    // if no existing entry found allocate space for new entry
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+LVEC_AVX2 void lvec_mul_i64_avx2(long long* r, long long* a, long long* b, int bstep, int n) {
+    int i = 0;
+    __m256i s = _mm256_set1_epi64x(b[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256i y = bstep ? _mm256_loadu_si256((__m256i*)(b + i)) : s;
+        __m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+        _mm256_storeu_si256((__m256i*)(r + i), lvec_mullo_epi64(x, y));
+    }
+    for (; i < n; i++) { r[i] = a[i] * b[i * bstep]; }
+}
 
-    // copy contents of lval and symbol string into new location
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc((strlen(k->sym)+1) * sizeof(char));
-    strcpy(e->syms[e->count-1], k->sym);
+LVEC_AVX2 void lvec_add_f64_avx2(double* r, double* a, double* b, int bstep, int n) {
+    int i = 0;
+    __m256d s = _mm256_set1_pd(b[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256d y = bstep ? _mm256_loadu_pd(b + i) : s;
+        _mm256_storeu_pd(r + i, _mm256_add_pd(_mm256_loadu_pd(a + i), y));
+    }
+    for (; i < n; i++) { r[i] = a[i] + b[i * bstep]; }
 }
-char* ltype_name(int t) {
-    switch (t){
-        case LVAL_NUM: return "Number";
-        case LVAL_SEXPR: return "S-Expression";
-        case LVAL_QEXPR: return "Q-Expression";
-        case LVAL_FUN: return "Function";
-        case LVAL_SYM: return "Symbol";
-        case LVAL_ERR: return "Error";
-        default: return "Unknown";
+
+LVEC_AVX2 void lvec_mul_f64_avx2(double* r, double* a, double* b, int bstep, int n) {
+    int i = 0;
+    __m256d s = _mm256_set1_pd(b[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256d y = bstep ? _mm256_loadu_pd(b + i) : s;
+        _mm256_storeu_pd(r + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), y));
     }
+    for (; i < n; i++) { r[i] = a[i] * b[i * bstep]; }
 }
-lval* builtin_head(lenv* e, lval* a) {
 
-    LASSERT(a, a->count == 1,
-        "Function 'head' passed too many arguments!"
-        "Got %i, Expected %i.",
-        a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        "Function 'head' passed incorrect type for argument 0. "
-        "Got %s, Expected %s",
-        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
-    LASSERT(a, a->cell[0]->count != 0,
-        "Function 'head' passed {}!");
+LVEC_AVX2 long long lvec_sum_i64_avx2(long long* a, int n) {
+    int i = 0;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((__m256i*)(a + i)));
+    }
+    long long s = lvec_hsum_epi64(acc);
+    for (; i < n; i++) { s += a[i]; }
+    return s;
+}
 
-    //otherwise we take the first argument
-    lval* v = lval_take(a, 0);
+LVEC_AVX2 double lvec_sum_f64_avx2(double* a, int n) {
+    int i = 0;
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+    }
+    double s = lvec_hsum_pd(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++) { s += a[i]; }
+    return s;
+}
 
-    //delete all elements that are not head and return
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+LVEC_AVX2 long long lvec_dot_i64_avx2(long long* a, long long* b, int n) {
+    int i = 0;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((__m256i*)(b + i));
+        acc = _mm256_add_epi64(acc, lvec_mullo_epi64(x, y));
+    }
+    long long s = lvec_hsum_epi64(acc);
+    for (; i < n; i++) { s += a[i] * b[i]; }
+    return s;
+}
+
+LVEC_AVX2 double lvec_dot_f64_avx2(double* a, double* b, int n) {
+    int i = 0;
+    __m256d acc = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(x, _mm256_loadu_pd(b + i)));
+    }
+    double s = lvec_hsum_pd(acc);
+    for (; i < n; i++) { s += a[i] * b[i]; }
+    return s;
+}
+
+LVEC_AVX2 long long lvec_min_i64_avx2(long long* a, int n) {
+    int i = 0;
+    long long t[4];
+    __m256i m = _mm256_set1_epi64x(a[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+        m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(m, x));
+    }
+    _mm256_storeu_si256((__m256i*)t, m);
+    long long r = lvec_min_i64_c(t, 4);
+    for (; i < n; i++) { if (a[i] < r) { r = a[i]; } }
+    return r;
+}
+
+LVEC_AVX2 long long lvec_max_i64_avx2(long long* a, int n) {
+    int i = 0;
+    long long t[4];
+    __m256i m = _mm256_set1_epi64x(a[0]);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+        m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(x, m));
+    }
+    _mm256_storeu_si256((__m256i*)t, m);
+    long long r = lvec_max_i64_c(t, 4);
+    for (; i < n; i++) { if (a[i] > r) { r = a[i]; } }
+    return r;
+}
+
+LVEC_AVX2 double lvec_min_f64_avx2(double* a, int n) {
+    int i = 0;
+    double t[4];
+    __m256d m = _mm256_set1_pd(a[0]);
+    for (; i + 4 <= n; i += 4) { m = _mm256_min_pd(m, _mm256_loadu_pd(a + i)); }
+    _mm256_storeu_pd(t, m);
+    double r = lvec_min_f64_c(t, 4);
+    for (; i < n; i++) { if (a[i] < r) { r = a[i]; } }
+    return r;
+}
+
+LVEC_AVX2 double lvec_max_f64_avx2(double* a, int n) {
+    int i = 0;
+    double t[4];
+    __m256d m = _mm256_set1_pd(a[0]);
+    for (; i + 4 <= n; i += 4) { m = _mm256_max_pd(m, _mm256_loadu_pd(a + i)); }
+    _mm256_storeu_pd(t, m);
+    double r = lvec_max_f64_c(t, 4);
+    for (; i < n; i++) { if (a[i] > r) { r = a[i]; } }
+    return r;
+}
+
+lvec_kernels lvec_avx2 = {
+    "avx2",
+    lvec_add_i64_avx2, lvec_mul_i64_avx2, lvec_add_f64_avx2, lvec_mul_f64_avx2,
+    lvec_sum_i64_avx2, lvec_sum_f64_avx2, lvec_dot_i64_avx2, lvec_dot_f64_avx2,
+    lvec_min_i64_avx2, lvec_max_i64_avx2, lvec_min_f64_avx2, lvec_max_f64_avx2
+};
+
+#endif
+
+lvec_kernels* lvec_kern = &lvec_portable;
+
+// Pick the best kernel set for the CPU we are running on
+void lvec_init(void) {
+#ifdef LVEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) { lvec_kern = &lvec_avx2; }
+#endif
+}
+
+// Convert an integer vector to float storage in place
+void lval_vec_to_flt(lval* v) {
+    if (v->vkind == LVEC_FLT) { return; }
+    long long* ints = v->vdata;
+    double* flts = lmem_alloc(v->arena, (v->count ? v->count : 1) * sizeof(double));
+    for (int i = 0; i < v->count; i++) { flts[i] = (double)ints[i]; }
+    lmem_free(v->arena, ints);
+    v->vdata = flts;
+    v->vkind = LVEC_FLT;
+}
+
+// Store lval 'x' as element 'i' of vector 'v'
+void lval_vec_set(lval* v, int i, lval* x) {
+    if (v->vkind == LVEC_INT) {
+        ((long long*)v->vdata)[i] = x->num;
+    } else {
+        ((double*)v->vdata)[i] = x->type == LVAL_DBL ? x->dbl : (double)x->num;
+    }
+}
+
+// Fetch element 'i' of vector 'v' as a new lval
+lval* lval_vec_get(lval* v, int i) {
+    if (v->vkind == LVEC_INT) { return lval_num(((long long*)v->vdata)[i]); }
+    return lval_dbl(((double*)v->vdata)[i]);
+}
+
+lval* builtin_vec(lenv* e, lval* a) {
+    LASSERT_NUM("vec", a, 1);
+    LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    int kind = LVEC_INT;
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, q->cell[i]->type == LVAL_NUM || q->cell[i]->type == LVAL_DBL,
+            "Function 'vec' passed non-number element %i. Got %s, Expected %s.",
+            i, ltype_name(q->cell[i]->type), ltype_name(LVAL_NUM));
+        if (q->cell[i]->type == LVAL_DBL) { kind = LVEC_FLT; }
+    }
+
+    lval* v = lval_vec(kind, q->count);
+    for (int i = 0; i < q->count; i++) { lval_vec_set(v, i, q->cell[i]); }
+    lval_del(a);
     return v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
+lval* builtin_vec_list(lenv* e, lval* a) {
+    LASSERT_NUM("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
 
-    LASSERT(a, a->count == 1,
-        "Function 'tail' passed too many arguments!"
-        "Got %i, Expected %i.",
+    lval* v = a->cell[0];
+    lval* q = lval_qexpr();
+    for (int i = 0; i < v->count; i++) { lval_add(q, lval_vec_get(v, i)); }
+    lval_del(a);
+    return q;
+}
+
+lval* builtin_vec_arith(lenv* e, lval* a, char* func) {
+    LASSERT_NUM(func, a, 2);
+
+    // put the vector first, arithmetic on scalars commutes
+    if (a->cell[0]->type != LVAL_VEC) {
+        lval* t = a->cell[0]; a->cell[0] = a->cell[1]; a->cell[1] = t;
+    }
+    LASSERT_TYPE(func, a, 0, LVAL_VEC);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    LASSERT(a, y->type == LVAL_VEC || y->type == LVAL_NUM || y->type == LVAL_DBL,
+        "Function '%s' passed incorrect type. Got %s, Expected %s.",
+        func, ltype_name(y->type), ltype_name(LVAL_VEC));
+    LASSERT(a, y->type != LVAL_VEC || y->count == x->count,
+        "Function '%s' passed vectors of different lengths. Got %i and %i.",
+        func, x->count, y->count);
+
+    // promote both operands to floats if either side is one
+    int flt = x->vkind == LVEC_FLT || y->type == LVAL_DBL
+        || (y->type == LVAL_VEC && y->vkind == LVEC_FLT);
+    long long si = y->num;
+    double sf = y->type == LVAL_DBL ? y->dbl : (double)y->num;
+    void* yd = y->type == LVAL_VEC ? y->vdata : (flt ? (void*)&sf : (void*)&si);
+    int step = y->type == LVAL_VEC ? 1 : 0;
+    if (flt) {
+        lval_vec_to_flt(x);
+        if (step) { lval_vec_to_flt(y); yd = y->vdata; }
+    }
+
+    // the result is written over the first operand
+    int mul = strcmp(func, "vec-mul") == 0;
+    if (flt) {
+        (mul ? lvec_kern->mul_f64 : lvec_kern->add_f64)(
+            x->vdata, x->vdata, yd, step, x->count);
+    } else {
+        (mul ? lvec_kern->mul_i64 : lvec_kern->add_i64)(
+            x->vdata, x->vdata, yd, step, x->count);
+    }
+
+    return lval_take(a, 0);
+}
+
+lval* builtin_vec_add(lenv* e, lval* a) {
+    return builtin_vec_arith(e, a, "vec-add");
+}
+
+lval* builtin_vec_mul(lenv* e, lval* a) {
+    return builtin_vec_arith(e, a, "vec-mul");
+}
+
+lval* builtin_vec_reduce(lenv* e, lval* a, char* func) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_VEC);
+
+    lval* v = a->cell[0];
+    lval* x = NULL;
+    if (strcmp(func, "vec-sum") == 0) {
+        x = v->vkind == LVEC_INT
+            ? lval_num(lvec_kern->sum_i64(v->vdata, v->count))
+            : lval_dbl(lvec_kern->sum_f64(v->vdata, v->count));
+        lval_del(a);
+        return x;
+    }
+
+    LASSERT(a, v->count != 0, "Function '%s' passed empty vector.", func);
+    int min = strcmp(func, "vec-min") == 0;
+    if (v->vkind == LVEC_INT) {
+        x = lval_num((min ? lvec_kern->min_i64 : lvec_kern->max_i64)(v->vdata, v->count));
+    } else {
+        x = lval_dbl((min ? lvec_kern->min_f64 : lvec_kern->max_f64)(v->vdata, v->count));
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+    return builtin_vec_reduce(e, a, "vec-sum");
+}
+
+lval* builtin_vec_min(lenv* e, lval* a) {
+    return builtin_vec_reduce(e, a, "vec-min");
+}
+
+lval* builtin_vec_max(lenv* e, lval* a) {
+    return builtin_vec_reduce(e, a, "vec-max");
+}
+
+lval* builtin_vec_dot(lenv* e, lval* a) {
+    LASSERT_NUM("vec-dot", a, 2);
+    LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    LASSERT(a, x->count == y->count,
+        "Function 'vec-dot' passed vectors of different lengths. Got %i and %i.",
+        x->count, y->count);
+
+    lval* r = NULL;
+    if (x->vkind == LVEC_INT && y->vkind == LVEC_INT) {
+        r = lval_num(lvec_kern->dot_i64(x->vdata, y->vdata, x->count));
+    } else {
+        lval_vec_to_flt(x);
+        lval_vec_to_flt(y);
+        r = lval_dbl(lvec_kern->dot_f64(x->vdata, y->vdata, x->count));
+    }
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_vec_map(lenv* e, lval* a) {
+    LASSERT_NUM("vec-map", a, 2);
+    LASSERT_TYPE("vec-map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("vec-map", a, 1, LVAL_VEC);
+
+    lval* f = a->cell[0];
+    lval* v = a->cell[1];
+
+    // results are written back into 'v', switching it to float
+    // storage the first time the function returns a float. Each call
+    // only leaves a number behind, so when evaluating into an arena its
+    // garbage is rewound before the next element.
+    larena* a0 = lspace_arena ? larena_live : NULL;
+    for (int i = 0; i < v->count; i++) {
+        larena_mark_t m;
+        if (a0) { m = larena_mark(a0); }
+        lval* g = lval_copy(f);
+        lval* r = lval_call(e, g, lval_add(lval_sexpr(), lval_vec_get(v, i)));
+        lval_del(g);
+        if (r->type == LVAL_ERR) { lval_del(a); return r; }
+        if (r->type != LVAL_NUM && r->type != LVAL_DBL) {
+            lval* err = lval_err(
+                "Function 'vec-map' mapped to non-number. Got %s, Expected %s.",
+                ltype_name(r->type), ltype_name(LVAL_NUM));
+            lval_del(r); lval_del(a);
+            return err;
+        }
+        lval n = *r;
+        lval_del(r);
+        if (a0) { larena_rewind(a0, m); }
+        if (n.type == LVAL_DBL) { lval_vec_to_flt(v); }
+        lval_vec_set(v, i, &n);
+    }
+
+    return lval_take(a, 1);
+}
+
+lval* lval_map(int set) {
+    lval* v = lval_new(set ? LVAL_SET : LVAL_MAP);
+    v->map = lmap_new(set);
+    return v;
+}
+
+#define LASSERT_COLL(func, args, index) \
+    LASSERT(args, args->cell[index]->type == LVAL_MAP \
+        || args->cell[index]->type == LVAL_SET, \
+        "Function '%s' passed incorrect type for argument %i. " \
+        "Got %s, Expected %s or %s.", \
+        func, index, ltype_name(args->cell[index]->type), \
+        ltype_name(LVAL_MAP), ltype_name(LVAL_SET))
+
+#define LASSERT_KEY(func, args, index) \
+    LASSERT(args, lval_hashable(args->cell[index]), \
+        "Function '%s' passed unhashable key of type %s.", \
+        func, ltype_name(args->cell[index]->type))
+
+lval* builtin_map_new(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 1,
+        "Function 'map-new' passed too many arguments. Got %i, Expected %i.",
         a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        "Function 'tail' passed incorrect type for argument 0. "
-        "Got %s, Expected %s",
-        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
-    LASSERT(a, a->cell[0]->count != 0,
-        "Function 'tail' passed {}!");
-    //Take first argument
-    lval* v = lval_take(a, 0);
+    if (a->count == 0) { lval_del(a); return lval_map(0); }
+    LASSERT_TYPE("map-new", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0] = lval_own(a->cell[0]);
+    LASSERT(a, q->count % 2 == 0,
+        "Function 'map-new' passed odd number of elements. Got %i.", q->count);
+    for (int i = 0; i < q->count; i += 2) {
+        LASSERT(a, lval_hashable(q->cell[i]),
+            "Function 'map-new' passed unhashable key of type %s.",
+            ltype_name(q->cell[i]->type));
+    }
 
-    //Delete first element and return
-    lval_del(lval_pop(v, 0));
+    lval* m = lval_map(0);
+    lmap_rebuild(m->map, q->count);
+    while (q->count) {
+        lval* k = lval_pop(q, 0);
+        lmap_put(m->map, k, lval_pop(q, 0));
+    }
+    lval_del(a);
+    return m;
+}
+
+lval* builtin_set_new(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 1,
+        "Function 'set-new' passed too many arguments. Got %i, Expected %i.",
+        a->count, 1);
+    if (a->count == 0) { lval_del(a); return lval_map(1); }
+    LASSERT_TYPE("set-new", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0] = lval_own(a->cell[0]);
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_hashable(q->cell[i]),
+            "Function 'set-new' passed unhashable element of type %s.",
+            ltype_name(q->cell[i]->type));
+    }
+
+    lval* m = lval_map(1);
+    lmap_rebuild(m->map, q->count * 2);
+    while (q->count) { lmap_put(m->map, lval_pop(q, 0), NULL); }
+    lval_del(a);
+    return m;
+}
+
+lval* builtin_get(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'get' passed incorrect number of arguments. "
+        "Got %i, Expected %i or %i.", a->count, 2, 3);
+    LASSERT_TYPE("get", a, 0, LVAL_MAP);
+    LASSERT_KEY("get", a, 1);
+
+    lmap* m = a->cell[0]->map;
+    int j = lmap_find(m, a->cell[1], lval_hash(a->cell[1]));
+    if (j < 0) {
+        // fall back to the default when one was given
+        if (a->count == 3) { return lval_take(a, 2); }
+        lval* err = lval_err("Function 'get' passed missing key.");
+        lval_del(a);
+        return err;
+    }
+
+    lval* v = lval_copy(m->vals[j]);
+    lval_del(a);
     return v;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+lval* builtin_assoc(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'assoc' passed no arguments.");
+    LASSERT_COLL("assoc", a, 0);
+
+    int set = a->cell[0]->type == LVAL_SET;
+    LASSERT(a, set || a->count % 2 == 1,
+        "Function 'assoc' passed a key without a value.");
+    for (int i = 1; i < a->count; i += set ? 1 : 2) { LASSERT_KEY("assoc", a, i); }
+
+    lval* m = lval_pop(a, 0);
+    while (a->count) {
+        lval* k = lval_pop(a, 0);
+        lmap_put(m->map, k, set ? NULL : lval_pop(a, 0));
+    }
+    lval_del(a);
+    return m;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT(a, a->count == 1,
-            "Function 'eval' passed too many arguments!"
-            "Got %i, Expected %i.",
-            a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "Function 'eval' passed incorrect type for argument 0. "
-            "Got %s, Expected %s",
-            ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+lval* builtin_dissoc(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'dissoc' passed no arguments.");
+    LASSERT_COLL("dissoc", a, 0);
+    for (int i = 1; i < a->count; i++) { LASSERT_KEY("dissoc", a, i); }
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    lval* m = lval_pop(a, 0);
+    for (int i = 0; i < a->count; i++) { lmap_remove(m->map, a->cell[i]); }
+    lval_del(a);
+    return m;
 }
 
-lval* lval_join (lval* x, lval* y) {
+lval* builtin_contains(lenv* e, lval* a) {
+    LASSERT_NUM("contains", a, 2);
+    LASSERT_COLL("contains", a, 0);
+    LASSERT_KEY("contains", a, 1);
 
-    // for each cell in 'y' add it to 'x'
-    while (y->count) {
-        lval_add(x, lval_pop(y, 0));
+    int j = lmap_find(a->cell[0]->map, a->cell[1], lval_hash(a->cell[1]));
+    lval_del(a);
+    return lval_num(j >= 0);
+}
+
+// Collect the keys or the values of a map into a Q-Expression
+lval* builtin_entries(lenv* e, lval* a, char* func) {
+    LASSERT_NUM(func, a, 1);
+    int vals = strcmp(func, "vals") == 0;
+    if (vals) { LASSERT_TYPE(func, a, 0, LVAL_MAP); } else { LASSERT_COLL(func, a, 0); }
+
+    lmap* m = a->cell[0]->map;
+    lval* q = lval_qexpr();
+    for (int i = 0; i < m->used; i++) {
+        if (!m->keys[i]) { continue; }
+        lval_add(q, lval_copy(vals ? m->vals[i] : m->keys[i]));
     }
+    lval_del(a);
+    return q;
+}
 
-    //delete the empty 'y' and return 'x'
-    lval_del(y);
+lval* builtin_keys(lenv* e, lval* a) {
+    return builtin_entries(e, a, "keys");
+}
+
+lval* builtin_vals(lenv* e, lval* a) {
+    return builtin_entries(e, a, "vals");
+}
+
+lval* builtin_str_len(lenv* e, lval* a) {
+    LASSERT_NUM("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+    lval* x = lval_num(a->cell[0]->slen);
+    lval_del(a);
     return x;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
+lval* builtin_str_sub(lenv* e, lval* a) {
+    LASSERT_NUM("str-sub", a, 3);
+    LASSERT_TYPE("str-sub", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-sub", a, 1, LVAL_NUM);
+    LASSERT_TYPE("str-sub", a, 2, LVAL_NUM);
+
+    lval* s = a->cell[0];
+    long long start = a->cell[1]->num;
+    long long n = a->cell[2]->num;
+    LASSERT(a, start >= 0 && n >= 0 && start + n <= s->slen,
+        "Function 'str-sub' passed range out of bounds. "
+        "Got %lli..%lli, Expected within 0..%li.", start, start + n, s->slen);
+
+    lval* x;
+    if (s->rope) {
+        char* buf = malloc(n + 1);
+        lrope_read(s->rope, start, n, buf);
+        x = lval_str_n(buf, n);
+        free(buf);
+    } else {
+        x = lval_str_n(s->sbuf + start, n);
+    }
+    lval_del(a);
+    return x;
+}
 
-    // Check Two arguments, each of which are Q-Expressions
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("LASSERT_TYPE", a, 1, LVAL_QEXPR);
+lval* builtin_str_find(lenv* e, lval* a) {
+    LASSERT_NUM("str-find", a, 2);
+    LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+
+    long n = a->cell[0]->slen;
+    long m = a->cell[1]->slen;
+    char* hay = lval_str_flat(a->cell[0]);
+    char* needle = lval_str_flat(a->cell[1]);
+
+    // scan for the first byte of the needle and compare from there
+    long found = m == 0 ? 0 : -1;
+    for (long i = 0; m && i + m <= n; i++) {
+        char* p = memchr(hay + i, needle[0], n - m - i + 1);
+        if (!p) { break; }
+        i = p - hay;
+        if (memcmp(p, needle, m) == 0) { found = i; break; }
+    }
 
-    // check first Q-Expression contains only symbols
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-        "Cannot define non-symbol. Got %s, Expected %s.",
-        ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    free(hay);
+    free(needle);
+    lval_del(a);
+    return lval_num(found);
+}
+
+lval* builtin_str_join(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("str-join", a, i, LVAL_STR);
+    }
+    if (a->count == 0) { lval_del(a); return lval_str(""); }
+
+    // short results never leave the inline buffer
+    long total = 0;
+    for (int i = 0; i < a->count; i++) { total += a->cell[i]->slen; }
+    if (total < LSTR_INLINE) {
+        lval* x = lval_str("");
+        for (int i = 0; i < a->count; i++) {
+            memcpy(x->sbuf + x->slen, a->cell[i]->sbuf, a->cell[i]->slen);
+            x->slen += a->cell[i]->slen;
+        }
+        x->sbuf[x->slen] = '\0';
+        lval_del(a);
+        return x;
     }
 
-    //Pop first two arguments and pass them to lval_lambda
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
+    lrope* r = lval_str_as_rope(a->cell[0]);
+    for (int i = 1; i < a->count; i++) {
+        r = lrope_join(r, lval_str_as_rope(a->cell[i]));
+    }
     lval_del(a);
+    return lval_str_rope(r);
+}
 
-    return lval_lambda(formals, body);
+lval* builtin_hashcons(lenv* e, lval* a) {
+    LASSERT_NUM("hashcons", a, 1);
+    LASSERT_TYPE("hashcons", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->count == 1 && q->cell[0]->type == LVAL_SYM,
+        "Function 'hashcons' passed incorrect argument. "
+        "Expected {on}, {off} or {stats}.");
+
+    char* cmd = q->cell[0]->sym;
+    if (strcmp(cmd, "on") == 0) { lhc.enabled = 1; }
+    else if (strcmp(cmd, "off") == 0) { lhc.enabled = 0; }
+    else if (strcmp(cmd, "stats") != 0) {
+        lval* err = lval_err("Function 'hashcons' passed unknown option '%s'.", cmd);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
+
+    // report how much of what was interned turned out to be shared
+    lval* x = lval_qexpr();
+    lval_add(x, lval_sym("enabled"));
+    lval_add(x, lval_num(lhc.enabled));
+    lval_add(x, lval_sym("unique"));
+    lval_add(x, lval_num(lhc.count));
+    lval_add(x, lval_sym("interned"));
+    lval_add(x, lval_num(lhc.requests));
+    lval_add(x, lval_sym("shared"));
+    lval_add(x, lval_num(lhc.shared));
+    lval_add(x, lval_sym("ratio"));
+    lval_add(x, lval_dbl(lhc.requests ? (double)lhc.shared / lhc.requests : 0));
+    return x;
+}
 
+lval* builtin_gc(lenv* e, lval* a) {
+    LASSERT_NUM("gc", a, 1);
+    LASSERT_TYPE("gc", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->count >= 1 && q->cell[0]->type == LVAL_SYM,
+        "Function 'gc' passed incorrect argument. Expected {stats}, "
+        "{histogram}, {nursery bytes} or {max-pause microseconds}.");
+
+    char* cmd = q->cell[0]->sym;
+    if (strcmp(cmd, "nursery") == 0 || strcmp(cmd, "max-pause") == 0) {
+        LASSERT(a, q->count == 2 && q->cell[1]->type == LVAL_NUM
+            && q->cell[1]->num > 0,
+            "Function 'gc' passed incorrect %s. Expected a positive number.",
+            cmd);
+        if (cmd[0] == 'n') {
+            lgc.nursery = q->cell[1]->num;
+            // a smaller nursery is collected as soon as it is full
+            if (larena_live && larena_live->allocated + lgc.nursery < lgc.next) {
+                lgc.next = larena_live->allocated + lgc.nursery;
+            }
+        }
+        else { lgc.max_pause = q->cell[1]->num; }
+    }
+    else if (strcmp(cmd, "histogram") == 0 && q->count == 1) {
+        lval_del(a);
+
+        // pairs of bucket upper bound in microseconds and count
+        lval* x = lval_qexpr();
+        for (int i = 0; i < LGC_BUCKETS; i++) {
+            if (!lgc.hist[i]) { continue; }
+            lval* b = lval_qexpr();
+            lval_add(b, i < LGC_BUCKETS - 1 ? lval_num(2L << i) : lval_sym("inf"));
+            lval_add(b, lval_num(lgc.hist[i]));
+            lval_add(x, b);
+        }
+        return x;
+    }
+    else if (strcmp(cmd, "stats") != 0 || q->count != 1) {
+        lval* err = lval_err("Function 'gc' passed unknown option '%s'.", cmd);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
 
+    // pauses are in microseconds, and count nursery resets too
+    lval* x = lval_qexpr();
+    lval_add(x, lval_sym("nursery"));
+    lval_add(x, lval_num(lgc.nursery));
+    lval_add(x, lval_sym("minor"));
+    lval_add(x, lval_num(lgc.minor));
+    lval_add(x, lval_sym("survived"));
+    lval_add(x, lval_num(lgc.survived));
+    lval_add(x, lval_sym("promoted"));
+    lval_add(x, lval_num(lgc.promoted));
+    lval_add(x, lval_sym("pending"));
+    lval_add(x, lval_num(lsweep.num));
+    lval_add(x, lval_sym("max-pause"));
+    lval_add(x, lval_dbl(lgc.max_pause));
+    lval_add(x, lval_sym("pause-max"));
+    lval_add(x, lval_dbl(lgc.pause_max));
+    lval_add(x, lval_sym("pause-avg"));
+    lval_add(x, lval_dbl(lgc.pauses ? lgc.pause_total / lgc.pauses : 0));
+    return x;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
+lval* builtin_inline(lenv* e, lval* a) {
+    LASSERT_NUM("inline", a, 1);
+    LASSERT_TYPE("inline", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->count == 1 && q->cell[0]->type == LVAL_SYM,
+        "Function 'inline' passed incorrect argument. "
+        "Expected {on}, {off}, {dump}, {quiet} or {stats}.");
+
+    char* cmd = q->cell[0]->sym;
+    if (strcmp(cmd, "on") == 0) { linl.enabled = 1; }
+    else if (strcmp(cmd, "dump") == 0) { linl.dump = 1; }
+    else if (strcmp(cmd, "quiet") == 0) { linl.dump = 0; }
+    else if (strcmp(cmd, "off") == 0) {
+        // give every optimized function its original body back
+        linl.enabled = 0;
+        int prev = lspace_set(0);
+        while (linl.count) { linline_restore(0, 0); }
+        lspace_set(prev);
+    }
+    else if (strcmp(cmd, "stats") != 0) {
+        lval* err = lval_err("Function 'inline' passed unknown option '%s'.", cmd);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-                "Function 'eval' passed incorrect type for argument 0. "
-                "Got %s, Expected %s",
-                ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+    lval* x = lval_qexpr();
+    lval_add(x, lval_sym("enabled"));
+    lval_add(x, lval_num(linl.enabled));
+    lval_add(x, lval_sym("functions"));
+    lval_add(x, lval_num(linl.count));
+    lval_add(x, lval_sym("sites"));
+    lval_add(x, lval_num(linl.sites));
+    lval_add(x, lval_sym("folds"));
+    lval_add(x, lval_num(linl.folds));
+    return x;
+}
+
+lval* builtin_spec(lenv* e, lval* a) {
+    LASSERT_NUM("spec", a, 1);
+    LASSERT_TYPE("spec", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->count == 1 && q->cell[0]->type == LVAL_SYM,
+        "Function 'spec' passed incorrect argument. "
+        "Expected {on}, {off}, {reset} or {stats}.");
+
+    char* cmd = q->cell[0]->sym;
+    if (strcmp(cmd, "on") == 0) { lspec.enabled = 1; }
+    else if (strcmp(cmd, "off") == 0) { lspec.enabled = 0; }
+    else if (strcmp(cmd, "reset") == 0) {
+        // profile every expression afresh
+        for (int i = 0; i < lspec.count; i++) {
+            lspec.sites[i].state = LSPEC_COLD;
+            lspec.sites[i].seen = 0;
+            lspec.sites[i].op = NULL;
+        }
+        lspec.hits = 0;
+        lspec.deopts = 0;
+    }
+    else if (strcmp(cmd, "stats") != 0) {
+        lval* err = lval_err("Function 'spec' passed unknown option '%s'.", cmd);
+        lval_del(a);
+        return err;
     }
+    lval_del(a);
+
+    int speculating = 0;
+    for (int i = 0; i < lspec.count; i++) {
+        if (lspec.sites[i].refs && lspec.sites[i].state == LSPEC_INT) { speculating++; }
+    }
+    long guarded = lspec.hits + lspec.deopts;
+
+    lval* x = lval_qexpr();
+    lval_add(x, lval_sym("enabled"));
+    lval_add(x, lval_num(lspec.enabled));
+    lval_add(x, lval_sym("sites"));
+    lval_add(x, lval_num(lspec.count - lspec.free_num));
+    lval_add(x, lval_sym("speculating"));
+    lval_add(x, lval_num(speculating));
+    lval_add(x, lval_sym("hits"));
+    lval_add(x, lval_num(lspec.hits));
+    lval_add(x, lval_sym("deopts"));
+    lval_add(x, lval_num(lspec.deopts));
+    lval_add(x, lval_sym("hit-rate"));
+    lval_add(x, lval_dbl(guarded ? (double)lspec.hits / guarded : 0.0));
+    return x;
+}
 
-    lval* x = lval_pop(a, 0);
+lval* builtin_jit(lenv* e, lval* a) {
+    LASSERT_NUM("jit", a, 1);
+    LASSERT_TYPE("jit", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->count >= 1 && q->cell[0]->type == LVAL_SYM,
+        "Function 'jit' passed incorrect argument. "
+        "Expected {on}, {off}, {stats} or {threshold calls}.");
+
+    char* cmd = q->cell[0]->sym;
+    if (strcmp(cmd, "threshold") == 0) {
+        LASSERT(a, q->count == 2 && q->cell[1]->type == LVAL_NUM
+            && q->cell[1]->num > 0,
+            "Function 'jit' passed incorrect threshold. "
+            "Expected a positive number.");
+        ljit.threshold = q->cell[1]->num;
+    }
+    else if (strcmp(cmd, "on") == 0 && q->count == 1) {
+        #ifndef LJIT_X86
+        lval_del(a);
+        return lval_err("Function 'jit' is only supported on x86-64 Linux.");
+        #endif
+        ljit.enabled = 1;
+    }
+    else if (strcmp(cmd, "off") == 0 && q->count == 1) { ljit.enabled = 0; }
+    else if (strcmp(cmd, "stats") != 0 || q->count != 1) {
+        lval* err = lval_err("Function 'jit' passed unknown option '%s'.", cmd);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    int mapped = 0;
+    for (int i = 0; i < ljit.count; i++) {
+        if (ljit.fns[i].code) { mapped++; }
     }
 
-    lval_del(x);
+    lval* x = lval_qexpr();
+    lval_add(x, lval_sym("enabled"));
+    lval_add(x, lval_num(ljit.enabled));
+    lval_add(x, lval_sym("threshold"));
+    lval_add(x, lval_num(ljit.threshold));
+    lval_add(x, lval_sym("compiled"));
+    lval_add(x, lval_num(ljit.compiled));
+    lval_add(x, lval_sym("slots"));
+    lval_add(x, lval_num(ljit.count - ljit.free_num));
+    lval_add(x, lval_sym("mapped"));
+    lval_add(x, lval_num(mapped));
+    lval_add(x, lval_sym("calls"));
+    lval_add(x, lval_num(ljit.calls));
+    lval_add(x, lval_sym("fallbacks"));
+    lval_add(x, lval_num(ljit.fallbacks));
     return x;
 }
 
-lval * builtin_op(lenv* e, lval* a, char* op) {
+void lenv_add_builtins(lenv* e) {
+    // This is the global environment, the one inlining looks into
+    linl.root = e;
+    lic.root = e;
 
-    //Ensure all arguments are numbers
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-number!");
-        }
-    }
+    // List Functions
+    lenv_add_builtin(e, "list", builtin_list);
+    lenv_add_builtin(e, "head", builtin_head);
+    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "join", builtin_join);
 
-    //pop the first element
-    lval* x = lval_pop(a, 0);
+    // Mathematical Functions
+    lenv_add_builtin(e, "+", builtin_add);
+    lenv_add_builtin(e, "-", builtin_sub);
+    lenv_add_builtin(e, "*", builtin_mul);
+    lenv_add_builtin(e, "/", builtin_div);
 
-    //if no arguments and sub then perform unary negation
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-        x->num = -x->num;
-    }
+    // Vector Functions
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-list", builtin_vec_list);
+    lenv_add_builtin(e, "vec-add", builtin_vec_add);
+    lenv_add_builtin(e, "vec-mul", builtin_vec_mul);
+    lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+    lenv_add_builtin(e, "vec-dot", builtin_vec_dot);
+    lenv_add_builtin(e, "vec-min", builtin_vec_min);
+    lenv_add_builtin(e, "vec-max", builtin_vec_max);
+    lenv_add_builtin(e, "vec-map", builtin_vec_map);
+
+    // Map and Set Functions
+    lenv_add_builtin(e, "map-new", builtin_map_new);
+    lenv_add_builtin(e, "set-new", builtin_set_new);
+    lenv_add_builtin(e, "get", builtin_get);
+    lenv_add_builtin(e, "assoc", builtin_assoc);
+    lenv_add_builtin(e, "dissoc", builtin_dissoc);
+    lenv_add_builtin(e, "keys", builtin_keys);
+    lenv_add_builtin(e, "vals", builtin_vals);
+    lenv_add_builtin(e, "contains", builtin_contains);
+
+    // String Functions
+    lenv_add_builtin(e, "str-len", builtin_str_len);
+    lenv_add_builtin(e, "str-sub", builtin_str_sub);
+    lenv_add_builtin(e, "str-find", builtin_str_find);
+    lenv_add_builtin(e, "str-join", builtin_str_join);
 
-    //while there are still elements remaining
-    while (a->count > 0) {
+    // Variable Functions
+    lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "=", builtin_put);
 
-        //pop the next element
-        lval* y = lval_pop(a, 0);
+    // Memory Functions
+    lenv_add_builtin(e, "hashcons", builtin_hashcons);
+    lenv_add_builtin(e, "gc", builtin_gc);
+    lenv_add_builtin(e, "inline", builtin_inline);
+    lenv_add_builtin(e, "spec", builtin_spec);
+    lenv_add_builtin(e, "jit", builtin_jit);
+}
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division by Zero!"); break;
-            }
-            x->num /= y->num;
-        }
+// Ahead-of-time compilation
+//
+// 'parsing --emit-c file' translates a script into a C program that
+// builds each top-level expression directly with the lval
+// constructors, so that it starts without parsing anything. The
+// program links against this file compiled with LISPY_RUNTIME, which
+// leaves out main. It runs as 'parsing file' would: expressions are
+// read as load reads them, whatever lines they span, only what they
+// print is written, errors go to stderr, and the exit status is a
+// failure if any expression failed.
+//
+// What the JIT would compile is compiled to C instead: integer '+', '-'
+// and '*' over literals and formals, wrapping as the builtins do. A
+// top-level expression of such arithmetic becomes a C function, called
+// in place of evaluating the expression while the operators are still
+// the builtins. A lambda defined at the top level with such a body
+// becomes a C function that lispy_native hands to its JIT slot once the
+// definition has run, and its calls use it until an operator is bound
+// globally or shadowed. Everything else, and everything once the guards
+// fail, goes through lispy_eval.
+
+lenv* lispy_env;
+larena* lispy_arena;
+larena_mark_t lispy_mark;
+
+// The expressions all run in one arena, as those of a loaded file do
+void lispy_init(void) {
+    lout = stdout;
+    lvec_init();
+    lispy_env = lenv_new();
+    lenv_add_builtins(lispy_env);
+    lispy_arena = larena_new();
+    lgc_begin(lispy_arena);
+    if (lspace_arena) { lispy_mark = larena_mark(larena_live); }
+}
 
-        lval_del(y);
+// Give a built expression what reading it would have
+void lval_annotate(lval* x) {
+    if (x->type == LVAL_SYM) { x->ic = lic_cell(x->sym); }
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return; }
+    for (int i = 0; i < x->count; i++) { lval_annotate(x->cell[i]); }
+}
 
+// Evaluate a top-level expression as load does
+void lispy_eval(lval* x) {
+    lval_annotate(x);
+    x = lval_eval(lispy_env, lmacro_expand(x, 0));
+    if (x->type == LVAL_ERR) {
+        fprintf(stderr, "Error: %s\n", x->err);
+        lload_failed++;
     }
+    lval_del(x);
 
-    lval_del(a);
-    return x;
+    if (lspace_arena) { lval_del(lgc_minor(lispy_mark, lval_sexpr())); }
+    lsweep_run(-1, lgc_now() + lgc.max_pause);
+}
 
+// Finish the program, giving its exit status
+int lispy_end(void) {
+    lgc_end();
+    larena_delete(lispy_arena);
+    return lload_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-lval * builtin_op(lenv* e, lval* a, char* op);
+// Whether the arithmetic operators are still the builtins
+int lispy_arith(void) {
+    lbuiltin ops[3] = { builtin_add, builtin_sub, builtin_mul };
+    char* names[3] = { "+", "-", "*" };
+    for (int i = 0; i < 3; i++) {
+        lval* f = lenv_find(lispy_env, names[i]);
+        if (!f || f->type != LVAL_FUN || f->builtin != ops[i]) { return 0; }
+    }
+    return 1;
+}
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+// Give the lambda bound globally as 'name' the native code 'code' for
+// its body, if it was bound with these 'formals' and 'body' and the
+// operators the code assumes are the builtins
+void lispy_native(char* name, ljit_code code, lval* formals, lval* body) {
+    lval* f = lenv_find(lispy_env, name);
+    if (f && f->type == LVAL_FUN && !f->builtin && f->jit
+        && f->env->count == 0 && lispy_arith()
+        && !linline_is_shadowed("+") && !linline_is_shadowed("-")
+        && !linline_is_shadowed("*")
+        && lval_eq(f->formals, formals) && lval_eq(f->body, body)) {
+        ljit_fn_t* j = &ljit.fns[f->jit - 1];
+        j->native = code;
+        j->native_version = ljit.version;
+        j->argc = formals->count;
+    }
+    lval_del(formals);
+    lval_del(body);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+// Write 'n' bytes of 's' as a C string literal
+void lispyc_emit_string(FILE* out, const char* s, long n) {
+    fputc('"', out);
+    for (long i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        // quotes, backslashes and trigraphs are escaped like control
+        // characters, with fixed width octal escapes
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+            fputc(c, out);
+        }
+        else { fprintf(out, "\\%03o", c); }
+    }
+    fputc('"', out);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+void lispyc_emit_num(FILE* out, long long n) {
+    if (n == LLONG_MIN) { fprintf(out, "(-%lldLL - 1)", LLONG_MAX); }
+    else { fprintf(out, "%lldLL", n); }
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+// Write an expression building 'x'
+void lispyc_emit_lval(FILE* out, lval* x) {
+    switch (x->type) {
+        case LVAL_NUM:
+            fprintf(out, "lval_num(");
+            lispyc_emit_num(out, x->num);
+            fprintf(out, ")");
+            break;
+        case LVAL_DBL: fprintf(out, "lval_dbl(%a)", x->dbl); break;
+        case LVAL_SYM:
+            fprintf(out, "lval_sym(");
+            lispyc_emit_string(out, x->sym, strlen(x->sym));
+            fprintf(out, ")");
+            break;
+        case LVAL_ERR:
+            fprintf(out, "lval_err(\"%%s\", ");
+            lispyc_emit_string(out, x->err, strlen(x->err));
+            fprintf(out, ")");
+            break;
+        case LVAL_STR: {
+            char* s = lval_str_flat(x);
+            fprintf(out, "lval_str_n(");
+            lispyc_emit_string(out, s, x->slen);
+            fprintf(out, ", %ld)", x->slen);
+            free(s);
+        }
+        break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < x->count; i++) { fprintf(out, "lval_add("); }
+            fprintf(out, x->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+            for (int i = 0; i < x->count; i++) {
+                fprintf(out, ", ");
+                lispyc_emit_lval(out, x->cell[i]);
+                fprintf(out, ")");
+            }
+            break;
+    }
 }
 
-lval* builtin(lenv* e, lval* a, char* func) {
-    if (strcmp("list", func) == 0) {return builtin_list(e, a);}
-    if (strcmp("head", func) == 0) {return builtin_head(e, a);}
-    if (strcmp("tail", func) == 0) {return builtin_tail(e, a);}
-    if (strcmp("join", func) == 0) {return builtin_join(e, a);}
-    if (strcmp("eval", func) == 0) {return builtin_eval(e, a);}
-    if (strstr("+-/*", func)) {return builtin_op(e, a, func);}
-    lval_del(a);
-    return lval_err("Unknown Function!");
+int lispyc_arith(lval* x, lval* formals);
+
+// Whether the element 'x' is integer arithmetic on literals and
+// 'formals', as ljit_expr would compile it
+int lispyc_arith_expr(lval* x, lval* formals) {
+    if (x->type == LVAL_NUM) { return 1; }
+    if (x->type == LVAL_SYM) {
+        return formals && linline_formal(formals, x->sym) >= 0;
+    }
+    if (x->type == LVAL_SEXPR) { return lispyc_arith(x, formals); }
+    return 0;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* v);
+// Whether 'x', evaluated as one S-Expression, is integer arithmetic on
+// literals and 'formals', as ljit_sexpr would compile it
+int lispyc_arith(lval* x, lval* formals) {
+    if (x->count == 0) { return 0; }
+    if (x->count == 1) { return lispyc_arith_expr(x->cell[0], formals); }
+    if (x->cell[0]->type != LVAL_SYM || !ljit_builtin(x->cell[0]->sym)) {
+        return 0;
+    }
+    for (int i = 1; i < x->count; i++) {
+        if (!lispyc_arith_expr(x->cell[i], formals)) { return 0; }
+    }
+    return 1;
+}
 
-lval* lval_eval_sexpr (lenv* e, lval* v) {
+void lispyc_emit_arith(FILE* out, lval* x, lval* formals);
 
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+// Write C computing the element 'x' as an unsigned long long
+void lispyc_emit_arith_expr(FILE* out, lval* x, lval* formals) {
+    if (x->type == LVAL_NUM) {
+        fprintf(out, "(unsigned long long)");
+        lispyc_emit_num(out, x->num);
+    }
+    else if (x->type == LVAL_SYM) {
+        fprintf(out, "(unsigned long long)args[%d]",
+            linline_formal(formals, x->sym));
     }
+    else { lispyc_emit_arith(out, x, formals); }
+}
 
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+// Write C computing 'x', which lispyc_arith accepts, in unsigned
+// arithmetic so that it wraps as the builtins do
+void lispyc_emit_arith(FILE* out, lval* x, lval* formals) {
+    if (x->count == 1) {
+        lispyc_emit_arith_expr(out, x->cell[0], formals);
+        return;
     }
 
-    if (v->count == 0) { return v; }
-    if (v->count == 1) { return lval_take(v, 0); }
+    char* op = x->cell[0]->sym;
+    fprintf(out, x->count == 2 && strcmp(op, "-") == 0 ? "(0 - " : "(");
+    for (int i = 1; i < x->count; i++) {
+        if (i > 1) { fprintf(out, " %s ", op); }
+        lispyc_emit_arith_expr(out, x->cell[i], formals);
+    }
+    fprintf(out, ")");
+}
 
-    //Ensure first element is a function after evaluation
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-            "S-Expression starts with incorrect type. "
-            "Got %s, Expected %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f); lval_del(v);
-        return err;
+// The lambda of '(def {name} (\ {formals} {body}))' if the JIT would
+// take its formals, or NULL
+lval* lispyc_lambda(lval* x) {
+    // a top-level expression is read into an S-Expression of its own
+    if (x->type == LVAL_SEXPR && x->count == 1) { x = x->cell[0]; }
+    if (x->type != LVAL_SEXPR || x->count != 3) { return NULL; }
+    lval* def = x->cell[0];
+    lval* name = x->cell[1];
+    lval* f = x->cell[2];
+    if (def->type != LVAL_SYM || strcmp(def->sym, "def") != 0
+        || name->type != LVAL_QEXPR || name->count != 1
+        || name->cell[0]->type != LVAL_SYM) { return NULL; }
+    if (f->type != LVAL_SEXPR || f->count != 3
+        || f->cell[0]->type != LVAL_SYM || strcmp(f->cell[0]->sym, "\\") != 0
+        || f->cell[1]->type != LVAL_QEXPR || f->cell[2]->type != LVAL_QEXPR) {
+        return NULL;
     }
 
-    //If so call function to get result
-    lval* result = lval_call(e, f , v);
-    lval_del(f);
-    return result;
+    // plain formals only, each named once
+    lval* formals = f->cell[1];
+    if (formals->count > LJIT_ARGS) { return NULL; }
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->type != LVAL_SYM) { return NULL; }
+        if (strcmp(formals->cell[i]->sym, "&") == 0) { return NULL; }
+        if (ljit_builtin(formals->cell[i]->sym)) { return NULL; }
+        if (linline_formal(formals, formals->cell[i]->sym) != i) { return NULL; }
+    }
+    return f;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k); lval_del(v);
-}
+// Write the expression 'x' as a statement of main to 'body', and any
+// native function it needs, numbered 'n', to 'out'
+void lispyc_emit_form(FILE* out, FILE* body, lval* x, int n) {
+    if (lispyc_arith_expr(x, NULL)) {
+        fprintf(out, "\nstatic long long lispyc_form_%d(void) {\n", n);
+        fprintf(out, "    return (long long)");
+        lispyc_emit_arith_expr(out, x, NULL);
+        fprintf(out, ";\n}\n");
+
+        fprintf(body, "    if (lispy_arith()) { lispyc_form_%d(); }\n", n);
+        fprintf(body, "    else { lispy_eval(");
+        lispyc_emit_lval(body, x);
+        fprintf(body, "); }\n");
+        return;
+    }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    //if builtin then simply add that
-    if (f->builtin) { return f->builtin(e, a);}
+    fprintf(body, "    lispy_eval(");
+    lispyc_emit_lval(body, x);
+    fprintf(body, ");\n");
+
+    lval* f = lispyc_lambda(x);
+    if (!f || !lispyc_arith(f->cell[2], f->cell[1])) { return; }
+    char* name = x->cell[0]->cell[1]->cell[0]->sym;
+
+    fprintf(out, "\nstatic long long lispyc_fn_%d(long long* args) {\n", n);
+    if (f->cell[1]->count == 0) { fprintf(out, "    (void)args;\n"); }
+    fprintf(out, "    return (long long)");
+    lispyc_emit_arith(out, f->cell[2], f->cell[1]);
+    fprintf(out, ";\n}\n");
+
+    fprintf(body, "    lispy_native(");
+    lispyc_emit_string(body, name, strlen(name));
+    fprintf(body, ", lispyc_fn_%d,\n        ", n);
+    lispyc_emit_lval(body, f->cell[1]);
+    fprintf(body, ",\n        ");
+    lispyc_emit_lval(body, f->cell[2]);
+    fprintf(body, ");\n");
+}
 
-    // record argument counts
-    int given = a->count;
-    int total = f->formals->count;
+// Translate the script 'filename' to C on stdout
+int lispyc(char* filename) {
+    FILE* in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "lispyc: could not open '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
 
-    // while arguments remain unprocessed
-    while (a->count) {
+    // main is written aside, as the native functions come before it
+    FILE* body = tmpfile();
+    if (!body) {
+        fprintf(stderr, "lispyc: could not create a temporary file\n");
+        fclose(in);
+        return EXIT_FAILURE;
+    }
 
-        //if we've ran out of formal arguments to bind
-        if (f->formals->count == 0) {
-           lval_del(a); return lval_err("Function passed too many arguments. "
-                   "Got %i, Expected %i", given, total);
-        }
+    FILE* out = stdout;
+    fprintf(out, "// Generated by 'parsing --emit-c %s'\n", filename);
+    fprintf(out, "typedef struct lval lval;\n");
+    fprintf(out, "lval* lval_num(long long x);\n");
+    fprintf(out, "lval* lval_dbl(double x);\n");
+    fprintf(out, "lval* lval_sym(char* s);\n");
+    fprintf(out, "lval* lval_err(char* fmt, ...);\n");
+    fprintf(out, "lval* lval_str_n(const char* s, long n);\n");
+    fprintf(out, "lval* lval_sexpr(void);\n");
+    fprintf(out, "lval* lval_qexpr(void);\n");
+    fprintf(out, "lval* lval_add(lval* v, lval* x);\n");
+    fprintf(out, "void lispy_init(void);\n");
+    fprintf(out, "void lispy_eval(lval* x);\n");
+    fprintf(out, "int lispy_end(void);\n");
+    fprintf(out, "int lispy_arith(void);\n");
+    fprintf(out, "void lispy_native(char* name, long long (*code)(long long* args),\n");
+    fprintf(out, "    lval* formals, lval* body);\n");
+
+    mpc_stream_t* st = mpc_stream_new(filename, Expr, (mpc_dtor_t)mpc_ast_delete);
+    char* chunk = malloc(LOAD_CHUNK);
+
+    mpc_result_t r;
+    int n = 0;
+    while (lload_next(st, in, chunk, &r)) {
+        mpc_ast_t* t = r.output;
+        fprintf(body, "\n    // line %ld\n", t->state.row + 1);
+        lval* x = lval_read(t);
+        mpc_ast_delete(t);
+        lispyc_emit_form(out, body, x, ++n);
+        lval_del(x);
+    }
 
-        // pop the first symbol from the formals
-        lval* sym = lval_pop(f->formals, 0);
+    fprintf(out, "\nint main(void) {\n");
+    fprintf(out, "    lispy_init();\n");
+    rewind(body);
+    size_t len;
+    while ((len = fread(chunk, 1, LOAD_CHUNK, body)) > 0) {
+        fwrite(chunk, 1, len, out);
+    }
+    fprintf(out, "    return lispy_end();\n}\n");
 
-        // pop the next argument from the list
-        lval* val = lval_pop(a, 0);
+    int status = EXIT_SUCCESS;
+    if (r.error) {
+        mpc_err_print_to(r.error, stderr);
+        mpc_err_delete(r.error);
+        status = EXIT_FAILURE;
+    }
 
-        // bind a copy into the functions environment
-        lenv_put(f->env, sym, val);
+    free(chunk);
+    mpc_stream_delete(st);
+    fclose(body);
+    fclose(in);
+    return status;
+}
 
-        // delete symbol and value
-        lval_del(sym); lval_del(val);
-    }
+#ifndef LISPY_RUNTIME
+
+// Batch Pipeline
+//
+// A script given on the command line runs in three stages: a reader
+// thread parses ahead of the evaluator, the main thread evaluates, and
+// a printer thread writes out what each expression printed. The stages
+// are joined by bounded single-producer single-consumer rings, so no
+// side takes a lock while there is work and the reader stays at most a
+// ring ahead. A side that finds its ring empty or full spins for a
+// moment, then sleeps until the other side moves an index.
+//
+// The reader hands on syntax trees rather than values, as building a
+// value touches the nursery, interned atoms and the inline cache and
+// speculation tables, all of which belong to the evaluator.
+
+#ifndef _WIN32
+#define LPIPE
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-    // argument list is now bound so can be cleaned up
-    lval_del(a);
+#ifdef LPIPE
+
+#define LRING_SLOTS 256
+#define LRING_SPIN 64
+
+// Each side only writes its own index, kept on its own cache line
+typedef struct {
+    size_t head;
+    char pad0[64 - sizeof(size_t)];
+    size_t tail;
+    char pad1[64 - sizeof(size_t)];
+    int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    void* slots[LRING_SLOTS];
+} lring;
+
+void lring_init(lring* q) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+}
 
-    // if all formals have been bound to evaluate
-    if (f->formals->count == 0) {
+void lring_destroy(lring* q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->wake);
+}
 
-        //set environment parent to evaluation environment
-        f->env->par = e;
+// Whether the pushing (or popping) side has room (or a value)
+int lring_ready(lring* q, int push) {
+    size_t h = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+    size_t t = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+    return push ? t - h < LRING_SLOTS : t != h;
+}
 
-        // evaluate and return
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    }
-    else {
-        // otherwise return partially evaluated function
-        return lval_copy(f);
+// Wait until the ring is ready for one side. The sleeper announces
+// itself before checking again and the other side checks for it after
+// moving its index, so one of them always sees the other.
+void lring_wait(lring* q, int push) {
+    for (int i = 0; i < LRING_SPIN; i++) {
+        if (lring_ready(q, push)) { return; }
+        sched_yield();
     }
+    pthread_mutex_lock(&q->lock);
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!lring_ready(q, push)) { pthread_cond_wait(&q->wake, &q->lock); }
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
 }
 
-lval* builtin_var (lenv* e, lval* a, char* func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+// Wake the other side if it went to sleep
+void lring_wake(lring* q) {
+    if (!__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) { return; }
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+}
 
-    lval* syms = a->cell[0];
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-            "Function '%s' cannot define non-symbol. "
-            "Got %s, Expected %s.", func,
-            ltype_name(syms->cell[i]->type),
-            ltype_name(LVAL_SYM));
+void lring_push(lring* q, void* x) {
+    size_t t = q->tail;
+    if (t - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == LRING_SLOTS) {
+        lring_wait(q, 1);
     }
+    q->slots[t % LRING_SLOTS] = x;
+    __atomic_store_n(&q->tail, t + 1, __ATOMIC_SEQ_CST);
+    lring_wake(q);
+}
 
-    LASSERT(a, syms->count == a->count -1,
-        "Function '%s' passed too many arguments for symbols. "
-        "Got %i, Expected %i. ", func, syms->count, a->count-1);
+void* lring_pop(lring* q) {
+    size_t h = q->head;
+    if (h == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) { lring_wait(q, 0); }
+    void* x = q->slots[h % LRING_SLOTS];
+    __atomic_store_n(&q->head, h + 1, __ATOMIC_SEQ_CST);
+    lring_wake(q);
+    return x;
+}
 
-    for (int i = 0; i < syms->count; i++) {
-        //if 'def' define in globally. If 'put' define in locally
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i+1]);
-        }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i+1]);
-        }
+// The reader sends trees, then one message without a tree carrying
+// any syntax error. The evaluator sends text for the printer to write,
+// then one message without text.
+typedef struct {
+    mpc_ast_t* ast;
+    mpc_err_t* err;
+    char* text;
+    size_t len;
+    FILE* to;
+} lpipe_msg;
+
+typedef struct {
+    char* filename;
+    FILE* file;
+    lring read;
+    lring print;
+} lpipe;
+
+void* lpipe_reader(void* arg) {
+    lpipe* p = arg;
+    mpc_stream_t* s = mpc_stream_new(p->filename, Expr, (mpc_dtor_t)mpc_ast_delete);
+    char* chunk = malloc(LOAD_CHUNK);
+
+    mpc_result_t r;
+    while (lload_next(s, p->file, chunk, &r)) {
+        lpipe_msg* msg = calloc(1, sizeof(lpipe_msg));
+        msg->ast = r.output;
+        lring_push(&p->read, msg);
     }
+    lpipe_msg* msg = calloc(1, sizeof(lpipe_msg));
+    msg->err = r.error;
+    lring_push(&p->read, msg);
 
-    lval_del(a);
-    return lval_sexpr();
+    free(chunk);
+    mpc_stream_delete(s);
+    return NULL;
 }
 
-lval* builtin_def (lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+// Messages arrive in the order they were written, but stdout is
+// buffered when redirected, so it is flushed before anything goes to
+// another stream
+void* lpipe_printer(void* arg) {
+    lpipe* p = arg;
+    lpipe_msg* msg;
+    FILE* last = NULL;
+    while ((msg = lring_pop(&p->print))->text) {
+        if (last && last != msg->to) { fflush(last); }
+        last = msg->to;
+        fwrite(msg->text, 1, msg->len, msg->to);
+        free(msg->text);
+        free(msg);
+    }
+    free(msg);
+    fflush(stdout);
+    return NULL;
 }
 
-
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+// Hand text captured by a memory stream on to the printer
+void lpipe_send(lpipe* p, char* text, size_t len, FILE* to) {
+    if (len == 0) { free(text); return; }
+    lpipe_msg* msg = calloc(1, sizeof(lpipe_msg));
+    msg->text = text;
+    msg->len = len;
+    msg->to = to;
+    lring_push(&p->print, msg);
 }
 
-void lenv_add_builtins(lenv* e) {
-    // List Functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+// Run a file as load does, evaluating on this thread while the reader
+// and printer threads work either side of it
+lval* lpipe_run(lenv* e, char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return lval_err("Could not load Library %s: error: Unable to open file!", filename);
+    }
 
-    // Mathematical Functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    lpipe* p = calloc(1, sizeof(lpipe));
+    p->filename = filename;
+    p->file = f;
+    lring_init(&p->read);
+    lring_init(&p->print);
+    pthread_t reader, printer;
+    pthread_create(&reader, NULL, lpipe_reader, p);
+    pthread_create(&printer, NULL, lpipe_printer, p);
+
+    larena_mark_t m;
+    if (lspace_arena) { m = larena_mark(larena_live); }
+    lpipe_msg* msg;
+    while ((msg = lring_pop(&p->read))->ast) {
+        char* text;
+        size_t len;
+        lout = open_memstream(&text, &len);
+        lval* x = lload_eval(e, msg->ast);
+        fclose(lout);
+        lout = stdout;
+        lpipe_send(p, text, len, stdout);
+
+        if (x->type == LVAL_ERR) {
+            FILE* err = open_memstream(&text, &len);
+            fprintf(err, "Error: %s\n", x->err);
+            fclose(err);
+            lpipe_send(p, text, len, stderr);
+            lload_failed++;
+        }
+        lval_del(x);
+        free(msg);
 
-    // Variable Functions
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "=", builtin_put);
+        // as in load
+        if (lspace_arena) { lval_del(lgc_minor(m, lval_sexpr())); }
+        lsweep_run(-1, lgc_now() + lgc.max_pause);
+    }
+    lval* err = msg->err ? lload_err(msg->err) : lval_sexpr();
+    free(msg);
+
+    lring_push(&p->print, calloc(1, sizeof(lpipe_msg)));
+    pthread_join(reader, NULL);
+    pthread_join(printer, NULL);
+    lring_destroy(&p->read);
+    lring_destroy(&p->print);
+    free(p);
+    fclose(f);
+    return err;
 }
 
+#endif
+
 int main (int argc, char** argv) {
 
-    // Create some parsers
-    mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Symbol = mpc_new("symbol");
-    mpc_parser_t* Sexpr = mpc_new("sexpr");
-    mpc_parser_t* Qexpr = mpc_new("qexpr");
-    mpc_parser_t* Expr = mpc_new("expr");
-    mpc_parser_t* Lispy = mpc_new("lispy");
+    lout = stdout;
+    lispy_parsers();
 
-    // Define them with the following language
-    mpca_lang(MPCA_LANG_DEFAULT,
-            " \
-            number: /-?[0-9]+/; \
-            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/; \
-            sexpr: '(' <expr>* ')'; \
-            qexpr: '{' <expr>* '}'; \
-            expr: <number> | <symbol> | <sexpr> | <qexpr> ;\
-            lispy : /^/ <expr>* /$/ ; \
-            ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    // Translate a script to C instead of running the prompt
+    if (argc == 3 && strcmp(argv[1], "--emit-c") == 0) {
+        int status = lispyc(argv[2]);
+        mpc_cleanup(7, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+        return status;
+    }
+
+    lvec_init();
+
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    // Each top-level expression is read and evaluated into one arena,
+    // released wholesale once its result has been printed
+    larena* arena = larena_new();
+
+    // Run the files given instead of the prompt, printing nothing but
+    // what they print themselves. The exit status is a failure if a
+    // file could not be read or any expression in it failed.
+    if (argc >= 2) {
+        int status = EXIT_SUCCESS;
+        for (int i = 1; i < argc; i++) {
+            lgc_begin(arena);
+#ifdef LPIPE
+            lval* x = lpipe_run(e, argv[i]);
+#else
+            lval* x = builtin_load(e, lval_add(lval_sexpr(), lval_str(argv[i])));
+#endif
+            if (x->type == LVAL_ERR) {
+                fprintf(stderr, "Error: %s\n", x->err);
+                status = EXIT_FAILURE;
+            }
+            lval_del(x);
+            lgc_end();
+        }
+        if (lload_failed) { status = EXIT_FAILURE; }
+
+        larena_delete(arena);
+        lenv_del(e);
+        mpc_cleanup(7, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+        return status;
+    }
 
     // Print Version and Exit Information
     puts("Lispy Version 0.0.0.0.1");
     puts("Press Ctrl+c to Exit\n");
 
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
+    // Lines are streamed through the parser so that an expression left
+    // open carries on onto the next line. The expressions of a line are
+    // gathered under one root and evaluated together once none is open.
+    mpc_stream_t* s = mpc_stream_new("<stdin>", Expr, (mpc_dtor_t)mpc_ast_delete);
+    mpc_ast_t* line = mpc_ast_new(">", "");
+
     while(1) {
-        char* input = readline("lispy> ");
+        char* input = readline(mpc_stream_pending(s) ? "  ...> " : "lispy> ");
+        if (!input) { break; }
         add_history(input);
 
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
+        mpc_stream_feed(s, input, strlen(input));
+        mpc_stream_feed(s, "\n", 1);
+        free(input);
 
-            lval* x = lval_eval(e, lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
+        mpc_result_t r;
+        while (mpc_stream_next(s, &r)) { mpc_ast_add_child(line, r.output); }
 
-            mpc_ast_delete(r.output);
-        } else {
+        if (r.error) {
             mpc_err_print(r.error);
             mpc_err_delete(r.error);
+        } else if (mpc_stream_pending(s)) {
+            continue;
+        } else {
+            lgc_begin(arena);
+            lval* x = lval_eval(e, lmacro_expand(lval_read(line), 0));
+            lval_println(x);
+            lgc_end();
         }
 
-        free(input);
+        mpc_ast_delete(line);
+        line = mpc_ast_new(">", "");
     }
 
+    mpc_ast_delete(line);
+    mpc_stream_delete(s);
+    larena_delete(arena);
     lenv_del(e);
 
-    mpc_cleanup(5, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    mpc_cleanup(7, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
     return EXIT_SUCCESS;
 }
+
+#endif
@@ -0,0 +1,288 @@
+/*
+** Parsing the same text from a string, a mapped file, a
+** file and a pipe must give the same AST, with the same
+** positions, or the same error.
+*/
+
+#include "../mpc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *modes[] = { "string", "mapped", "file", "pipe" };
+
+static mpc_parser_t *Number, *String, *Symbol, *Sexpr, *Qexpr, *Expr, *Lispy, *Forms, *Strict;
+
+static char *slurp(FILE *f) {
+  long n;
+  char *s;
+  fseek(f, 0, SEEK_END);
+  n = ftell(f);
+  rewind(f);
+  s = malloc(n + 1);
+  s[fread(s, 1, n, f)] = '\0';
+  return s;
+}
+
+/* The printed AST or error of parsing 'text' with 'p' in mode 'mode' */
+static char *run(mpc_parser_t *p, int mode, const char *path, const char *text) {
+  mpc_result_t r;
+  FILE *f, *out = tmpfile();
+  char *s;
+  int ok;
+
+  if (mode == 0) {
+    ok = mpc_parse(path, text, p, &r);
+  } else if (mode == 1) {
+    ok = mpc_parse_contents(path, p, &r);
+  } else {
+    f = fopen(path, "rb");
+    ok = mode == 2 ? mpc_parse_file(path, f, p, &r) : mpc_parse_pipe(path, f, p, &r);
+    fclose(f);
+  }
+
+  if (ok) {
+    mpc_ast_print_to(r.output, out);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print_to(r.error, out);
+    mpc_err_delete(r.error);
+  }
+
+  s = slurp(out);
+  fclose(out);
+  return s;
+}
+
+static int check(const char *what, mpc_parser_t *p, const char *text) {
+  const char *path = "input.tmp";
+  char *want, *got;
+  int mode, failed = 0;
+  FILE *f = fopen(path, "wb");
+  fputs(text, f);
+  fclose(f);
+
+  want = run(p, 0, path, text);
+  for (mode = 1; mode < 4; mode++) {
+    got = run(p, mode, path, text);
+    if (strcmp(got, want) != 0) {
+      printf("input %s: %s gave\n%s\nbut string gave\n%s\n", what, modes[mode], got, want);
+      failed++;
+    }
+    free(got);
+  }
+
+  free(want);
+  remove(path);
+  return failed;
+}
+
+/*
+** File and pipe input is read a block at a time, so forms,
+** tokens and backtracking straddle the block boundaries
+*/
+static int blocks(void) {
+  enum { BLOCK = 4096, LONG = 3 * BLOCK };
+  char *text = malloc(4 * LONG), *c;
+  int at, failed = 0;
+
+  /* A symbol starting like a number, at each offset around a boundary */
+  for (at = BLOCK - 4; at <= BLOCK + 1; at++) {
+    c = text;
+    *c++ = '(';
+    while (c - text < at) { *c++ = ' '; }
+    memcpy(c, "-ab)", 4);
+    for (c += 4; c - text < 2 * BLOCK; c += 6) { memcpy(c, " {1 2}", 6); }
+    strcpy(c, "\n");
+    failed += check("boundary", Lispy, text);
+  }
+
+  /* One line several blocks long, and a string literal longer than a block */
+  c = text;
+  while (c - text < LONG) { memcpy(c, "(a {1 2} \"s\") ", 15); c += 15; }
+  *c++ = '"';
+  while (c - text < 2 * LONG) { *c++ = 'x'; }
+  strcpy(c, "\"\n(b)\n");
+  failed += check("long line", Lispy, text);
+
+  free(text);
+  return failed;
+}
+
+/*
+** File and pipe input forgets the newlines it has passed, so
+** positions many lines in must still be counted from the start
+*/
+static int lines(void) {
+  enum { LINES = 3000 };
+  char *text = malloc(16 * LINES + 64), *c = text;
+  int j, failed = 0;
+
+  for (j = 0; j < LINES; j++) { c += sprintf(c, "(a {%d})\n", j); }
+  strcpy(c, "(last)\n");
+  failed += check("many lines", Lispy, text);
+  failed += check("many lines", Forms, text);
+
+  strcpy(c, "  (b \"s\" ]\n");
+  failed += check("late error", Lispy, text);
+  failed += check("late error", Forms, text);
+
+  /* A form left open from the first line to the last */
+  text[6] = ' ';
+  strcpy(c, "(b)\n");
+  failed += check("unclosed", Lispy, text);
+  failed += check("unclosed", Forms, text);
+
+  free(text);
+  return failed;
+}
+
+/* What a stream fed 'text' in chunks of 'n' yields, up to its first error */
+static char *streamed(const char *text, size_t n) {
+  mpc_stream_t *s = mpc_stream_new("input.tmp", Strict, (mpc_dtor_t)mpc_ast_delete);
+  size_t len = strlen(text), j;
+  FILE *out = tmpfile();
+  mpc_result_t r;
+  int error = 0, finished = 0;
+  char *got;
+
+  for (j = 0; !error && !finished; j += n) {
+    if (j < len) { mpc_stream_feed(s, text + j, len - j < n ? len - j : n); }
+    else { mpc_stream_finish(s); finished = 1; }
+    while (mpc_stream_next(s, &r)) {
+      mpc_ast_print_to(r.output, out);
+      mpc_ast_delete(r.output);
+    }
+    if (r.error) {
+      mpc_err_print_to(r.error, out);
+      mpc_err_delete(r.error);
+      error = 1;
+    }
+  }
+
+  got = slurp(out);
+  fclose(out);
+  mpc_stream_delete(s);
+  return got;
+}
+
+/*
+** Errors are only built once a parse has failed, from a
+** second pass where the input allows one, so they must not
+** depend on how the input arrives
+*/
+static int errors(void) {
+  static const char *cases[] = {
+    "]",
+    "(a b\n",
+    "(a \"open\n\n",
+    "(a) {b} (c {d ]}) (e)\n",
+    "(def {x} 1)\n(def {y} 2)\n  (print x y))\n(ok)\n",
+    "(a\n  (b\n    (c 1 2 3 -)\n  \"s\")\n}\n",
+    "(a)\n#(b)\n",
+    "(a) #"
+  };
+  static const size_t chunks[] = { 1, 2, 7 };
+  int j, k, failed = 0;
+  char *want, *got;
+
+  for (j = 0; j < (int)(sizeof(cases) / sizeof(cases[0])); j++) {
+    failed += check("error", Lispy, cases[j]);
+    failed += check("error", Forms, cases[j]);
+
+    want = streamed(cases[j], strlen(cases[j]));
+    for (k = 0; k < (int)(sizeof(chunks) / sizeof(chunks[0])); k++) {
+      got = streamed(cases[j], chunks[k]);
+      if (strcmp(got, want) != 0) {
+        printf("input error: stream in chunks of %d gave\n%s\nbut whole gave\n%s\n",
+          (int)chunks[k], got, want);
+        failed++;
+      }
+      free(got);
+    }
+    free(want);
+  }
+
+  return failed;
+}
+
+/* A pipe is left where the parse stopped, for its reader to carry on */
+static int pushback(void) {
+  static const char *cases[][2] = {
+    { "(a b) (c d)\nrest\n", "(c d)\nrest\n" },
+    { "{1 2}\n(c)", "(c)" },
+    { "-ab ]", "]" },
+    { "] x\ny", "] x\ny" }
+  };
+  mpc_result_t r;
+  char rest[64];
+  size_t n;
+  int j, failed = 0;
+
+  for (j = 0; j < (int)(sizeof(cases) / sizeof(cases[0])); j++) {
+    FILE *f = tmpfile();
+    fputs(cases[j][0], f);
+    rewind(f);
+    if (mpc_parse_pipe("pipe", f, Expr, &r)) { mpc_ast_delete(r.output); }
+    else { mpc_err_delete(r.error); }
+    n = fread(rest, 1, sizeof(rest) - 1, f);
+    rest[n] = '\0';
+    fclose(f);
+    if (strcmp(rest, cases[j][1]) != 0) {
+      printf("input pushback: left \"%s\", expected \"%s\"\n", rest, cases[j][1]);
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+int main(void) {
+  int failed = 0;
+
+  Number = mpc_new("number");
+  String = mpc_new("string");
+  Symbol = mpc_new("symbol");
+  Sexpr  = mpc_new("sexpr");
+  Qexpr  = mpc_new("qexpr");
+  Expr   = mpc_new("expr");
+  Lispy  = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+(\\.[0-9]+)?/ ;                       "
+    " string : /\"(\\\\.|[^\"])*\"/ ;                          "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;              "
+    " sexpr  : '(' <expr>* ')' ;                               "
+    " qexpr  : '{' <expr>* '}' ;                               "
+    " expr   : <number> | <string> | <symbol> | <sexpr> | <qexpr> ; "
+    " lispy  : /^/ <expr>* /$/ ;                               ",
+    Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  /* Without an outer sequence nothing holds on to the start */
+  Forms = mpc_many(mpcf_fold_ast, Expr);
+
+  /* A failure rather than an error, which more input cannot undo */
+  Strict = mpc_or(2,
+    mpc_and(2, mpcf_fst_free, mpc_char('#'), mpc_fail("directives are not allowed"), free),
+    Expr);
+
+  failed += check("empty", Lispy, "");
+  failed += check("one form", Lispy, "(+ 1 2)\n");
+  failed += check("no newline", Lispy, "(def {x} 1.5) x");
+  failed += check("program", Lispy,
+    "(def {sq} (\\ {x} {* x x}))\n"
+    "\n"
+    "  (print (sq 3) \"a \\\"quoted\\\" string\n"
+    "over lines\")\n"
+    "{1 {2 {3}} -4}\n");
+
+  failed += blocks();
+  failed += lines();
+  failed += errors();
+  failed += pushback();
+
+  mpc_delete(Forms);
+  mpc_delete(Strict);
+  mpc_cleanup(7, Number, String, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/*
+** Deep input to a grammar whose alternatives share a
+** prefix must fail quickly under every packrat policy
+** once it passes the recursion limit, rather than going
+** back to exponential backtracking.
+*/
+
+#include "../mpc.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *policies[] = { "full", "window", "rules" };
+
+static char *nested(int n, char close) {
+  int j;
+  char *s = malloc(3 * n + 2), *c = s;
+  for (j = 0; j < n; j++) { *c++ = '('; }
+  *c++ = 'x';
+  for (j = 0; j < n; j++) { *c++ = ')'; *c++ = close; }
+  *c = '\0';
+  return s;
+}
+
+static int check(int policy, int n, char close, int expect) {
+  mpc_parser_t *S = mpc_new("s"), *P;
+  mpc_result_t r;
+  char *input = nested(n, close);
+  int ok;
+
+  mpca_lang(MPCA_LANG_DEFAULT, " s : '(' <s> ')' 'a' | '(' <s> ')' 'b' | 'x' ; ", S, NULL);
+  if (policy == MPC_PACKRAT_RULES) { mpc_memoize(S); }
+  P = mpca_packrat(S, policy, 64);
+
+  ok = mpc_parse("deep", input, P, &r);
+  if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+
+  mpc_delete(P);
+  mpc_cleanup(1, S);
+  free(input);
+
+  if (ok != expect) {
+    printf("packrat %s: depth %d %s\n", policies[policy], n, ok ? "parsed" : "failed");
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  int policy, failed = 0;
+
+  /* Exponential backtracking would run for minutes */
+  alarm(10);
+
+  for (policy = MPC_PACKRAT_FULL; policy <= MPC_PACKRAT_RULES; policy++) {
+    failed += check(policy, 120, 'b', 1);
+    failed += check(policy, 120, 'a', 1);
+    failed += check(policy, 200, 'b', 0);
+    failed += check(policy, 2000, 'b', 0);
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/*
+** A regex compiled to a DFA must match exactly what its
+** combinators match. Each regex is run on the same inputs
+** both ways, over string and pipe input, and regexes the
+** DFA cannot reproduce must keep their combinators.
+*/
+
+/* Included whole to see which regexes became a DFA */
+#include "../mpc.c"
+
+typedef struct {
+  const char *re;
+  int dfa;
+  const char *inputs[8];
+} regex_case_t;
+
+static const regex_case_t cases[] = {
+
+  /* Backtracking into what a repetition or alternative took */
+  { "a*ab",     0, { "aab", "ab", "aaab", "b", "", NULL } },
+  { "(ab|a)c",  0, { "abc", "ac", "abd", "a", NULL } },
+
+  /* A count failing partway */
+  { "a{3}",     0, { "aa", "aaa", "aaaa", "", NULL } },
+  { "a{3}b",    1, { "aab", "aaab", "aaaab", NULL } },
+
+  /* Only the last alternative may be nullable */
+  { "(a?|b)c",  0, { "c", "ac", "bc", "b", NULL } },
+  { "(a|b?)c",  1, { "c", "ac", "bc", "b", "abc", NULL } },
+
+  /* Anchors */
+  { "^a$",      0, { "a", "ab", "", NULL } },
+
+  /* parsing.c's number and symbol, and the tutorial's comment and string */
+  { "-?[0-9]+(\\.[0-9]+)?", 1,
+    { "12", "-3.5", "1.", "1.x", "-", "x", "007.25rest", NULL } },
+  { "[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+", 1,
+    { "foo bar", "+", "a-b)", "\\x", ")", "", NULL } },
+  { ";[^\\r\\n]*", 1, { "; hi\nnext", ";", ";\r", "x", NULL } },
+  { "\"(\\\\.|[^\"])*\"", 0,
+    { "\"hi\" x", "\"a\\\"b\"", "\"open", "\"\\\\\"", NULL } }
+};
+
+static mpc_val_t *fold_pair(int n, mpc_val_t **xs) {
+  char *s = malloc(strlen(xs[0]) + strlen(xs[1]) + 2);
+  (void) n;
+  sprintf(s, "%s|%s", (char*)xs[0], (char*)xs[1]);
+  free(xs[0]);
+  free(xs[1]);
+  return s;
+}
+
+/* What 'x' matches of 'input' and what it leaves, or NULL */
+static char *run(mpc_parser_t *x, const char *input, int pipe) {
+  mpc_parser_t *p = mpc_and(2, fold_pair, x, mpc_many(mpcf_strfold, mpc_any()), free);
+  mpc_result_t r;
+  char *out = NULL;
+  int ok;
+
+  if (pipe) {
+    FILE *f = tmpfile();
+    fputs(input, f);
+    rewind(f);
+    ok = mpc_parse_pipe("regex", f, p, &r);
+    fclose(f);
+  } else {
+    ok = mpc_parse("regex", input, p, &r);
+  }
+  if (ok) { out = r.output; } else { mpc_err_delete(r.error); }
+
+  /* leave 'x' to the caller */
+  p->data.and.xs[0] = mpc_pass();
+  mpc_delete(p);
+  return out;
+}
+
+static int check(const regex_case_t *c) {
+  mpc_parser_t *R = mpc_new("regex"), *E;
+  int j, pipe, failed = 0;
+
+  mpc_define(R, mpc_re(c->re));
+  if ((R->type == MPC_TYPE_DFA) != c->dfa) {
+    printf("regex /%s/: %s\n", c->re, c->dfa ? "no DFA" : "unexpected DFA");
+    failed++;
+  }
+
+  /* The DFA runs only where errors are suppressed */
+  E = mpc_expect(R, "regex");
+
+  for (j = 0; c->inputs[j]; j++) {
+    for (pipe = 0; pipe < 2; pipe++) {
+      char *tree = run(R, c->inputs[j], pipe);
+      char *dfa = run(E, c->inputs[j], pipe);
+      if ((tree == NULL) != (dfa == NULL) || (tree && strcmp(tree, dfa) != 0)) {
+        printf("regex /%s/ on \"%s\" (%s): combinators %s, DFA %s\n",
+          c->re, c->inputs[j], pipe ? "pipe" : "string",
+          tree ? tree : "fail", dfa ? dfa : "fail");
+        failed++;
+      }
+      free(tree);
+      free(dfa);
+    }
+  }
+
+  mpc_delete(E);
+  mpc_cleanup(1, R);
+  return failed;
+}
+
+int main(void) {
+  int j, failed = 0;
+  for (j = 0; j < (int)(sizeof(cases) / sizeof(cases[0])); j++) {
+    failed += check(&cases[j]);
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+/*
+** A stream must yield the same forms however its input
+** is split into chunks, hold back a form that more input
+** could still extend, and retry a large incomplete form
+** only as often as its doubling allows.
+*/
+
+#include "../mpc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static long atoms = 0;
+
+static mpc_val_t *count_atom(mpc_val_t *x) { atoms++; return x; }
+
+static mpc_val_t *fold_join(int n, mpc_val_t **xs) {
+  size_t len = 1;
+  int j;
+  char *s;
+  for (j = 0; j < n; j++) { len += strlen(xs[j]) + 1; }
+  s = calloc(len, 1);
+  for (j = 0; j < n; j++) {
+    if (j) { strcat(s, " "); }
+    strcat(s, xs[j]);
+    free(xs[j]);
+  }
+  return s;
+}
+
+static mpc_val_t *wrap_parens(mpc_val_t *x) {
+  char *s = malloc(strlen(x) + 3);
+  sprintf(s, "(%s)", (char*)x);
+  free(x);
+  return s;
+}
+
+static mpc_parser_t *Expr;
+
+static mpc_stream_t *stream(void) {
+  return mpc_stream_new("stream", Expr, free);
+}
+
+static char *copy(const char *x) {
+  char *s = malloc(strlen(x) + 1);
+  strcpy(s, x);
+  return s;
+}
+
+/* The next form, "" if none is ready, or "!" on an error */
+static char *next(mpc_stream_t *s) {
+  mpc_result_t r;
+  if (mpc_stream_next(s, &r)) { return r.output; }
+  if (r.error) { mpc_err_delete(r.error); return copy("!"); }
+  return copy("");
+}
+
+static void feed(mpc_stream_t *s, const char *text) {
+  mpc_stream_feed(s, text, strlen(text));
+}
+
+static int expect(const char *what, char *got, const char *want) {
+  int failed = strcmp(got, want) != 0;
+  if (failed) { printf("stream %s: got \"%s\", expected \"%s\"\n", what, got, want); }
+  free(got);
+  return failed;
+}
+
+static int split_number(void) {
+  mpc_stream_t *s = stream();
+  int failed = 0;
+  feed(s, "12");
+  failed += expect("split number", next(s), "");
+  feed(s, "3");
+  failed += expect("split number", next(s), "");
+  feed(s, "\n");
+  failed += expect("split number", next(s), "123");
+  failed += expect("split number", next(s), "");
+  mpc_stream_delete(s);
+  return failed;
+}
+
+static int split_token(void) {
+  mpc_stream_t *s = stream();
+  int failed = 0;
+  feed(s, "(ab");
+  failed += expect("split token", next(s), "");
+  feed(s, "c d)");
+  failed += expect("split token", next(s), "");
+  feed(s, " (e");
+  failed += expect("split token", next(s), "(abc d)");
+  failed += expect("split token", next(s), "");
+  feed(s, ")\n");
+  failed += expect("split token", next(s), "(e)");
+  mpc_stream_delete(s);
+  return failed;
+}
+
+static int hard_error(void) {
+  mpc_stream_t *s = stream();
+  int failed = 0;
+  feed(s, "(a b) ) (c)\n");
+  failed += expect("hard error", next(s), "(a b)");
+  failed += expect("hard error", next(s), "!");
+  failed += expect("hard error", next(s), "");
+  feed(s, "(d)\n");
+  failed += expect("hard error", next(s), "(d)");
+  mpc_stream_delete(s);
+  return failed;
+}
+
+static int finish_incomplete(void) {
+  mpc_stream_t *s = stream();
+  int failed = 0;
+  feed(s, "(a) (b (c");
+  failed += expect("finish", next(s), "(a)");
+  failed += expect("finish", next(s), "");
+  if (!mpc_stream_pending(s)) {
+    printf("stream finish: nothing pending\n");
+    failed++;
+  }
+  mpc_stream_finish(s);
+  failed += expect("finish", next(s), "!");
+  failed += expect("finish", next(s), "");
+  mpc_stream_delete(s);
+  return failed;
+}
+
+/* A form several times MPC_STREAM_EAGER fed in small chunks */
+static int large_form(void) {
+  enum { ATOMS = 25000, CHUNK = 1024 };
+  mpc_stream_t *s = stream();
+  size_t len = 2 + 8 * ATOMS, j;
+  char *form = malloc(len + 1), *c = form, *got;
+  int failed = 0;
+
+  *c++ = '(';
+  for (j = 0; j < ATOMS; j++) { memcpy(c, "abcdefg ", 8); c += 8; }
+  *c++ = ')';
+  *c = '\0';
+
+  atoms = 0;
+  for (j = 0; j < len; j += CHUNK) {
+    mpc_stream_feed(s, form + j, len - j < CHUNK ? len - j : CHUNK);
+    failed += expect("large form", next(s), "");
+  }
+  feed(s, "\n");
+  got = next(s);
+  if (got[0] == '\0') {
+    free(got);
+    mpc_stream_finish(s);
+    got = next(s);
+  }
+
+  if (strlen(got) != len - 1) {
+    printf("stream large form: got %lu bytes, expected %lu\n",
+      (unsigned long)strlen(got), (unsigned long)(len - 1));
+    failed++;
+  }
+  free(got);
+
+  /* Retrying on every chunk would parse about a hundred times as many */
+  if (atoms > 10 * ATOMS) {
+    printf("stream large form: parsed %ld atoms for %d\n", atoms, ATOMS);
+    failed++;
+  }
+
+  mpc_stream_delete(s);
+  free(form);
+  return failed;
+}
+
+int main(void) {
+  int failed = 0;
+
+  Expr = mpc_new("expr");
+  mpc_define(Expr, mpc_or(2,
+    mpc_apply(mpc_tok(mpc_re("[a-z0-9]+")), count_atom),
+    mpc_apply(mpc_tok_parens(mpc_many(fold_join, Expr), free), wrap_parens)));
+
+  failed += split_number();
+  failed += split_token();
+  failed += hard_error();
+  failed += finish_incomplete();
+  failed += large_form();
+
+  mpc_cleanup(1, Expr);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}